@@ -1,8 +1,10 @@
 #include "cpu.h"
+#include "metrics.h"
 
 cpu_t* init_cpu() {
     // Allocate memory on heap to store CPU
     cpu_t* cpu = (cpu_t*)malloc(sizeof(cpu_t));
+    memset(cpu, 0, sizeof(cpu_t));
 
     // Initialize memory
     cpu->memory = (unsigned char*)malloc(sizeof(unsigned char) * memory_size);
@@ -13,6 +15,7 @@ cpu_t* init_cpu() {
 
     // Initialize the registers;
     unsigned short subroutine_nesting = 0;
+    cpu->rng = 0x2545f491;
 
     // Initialize io buffer
     for (size_t i = 0; i < sizeof(cpu->io_buff) / sizeof(char); i++) {
@@ -29,35 +32,48 @@ void free_cpu(cpu_t* cpu) {
 }
 
 void cpu_load_program(cpu_t* cpu, const char* fname) {
+    if (cpu_try_load_program(cpu, fname) == false) {
+        exit(-1);
+    }
+}
+
+bool cpu_try_load_program(cpu_t* cpu, const char* fname) {
     // Copy the data of the program into a buffer
-    unsigned char* fdata = read_file_binary(fname);
+    size_t fdata_len = 0;
+    unsigned char* fdata = read_file_binary(fname, &fdata_len);
     if (fdata == NULL) {
-        Log("Unable to load program into memory!", 3);
-        exit(-1);
+        Log("Unable to load program into memory!", 2);
+        return false;
     }
 
     // Check if the size of the program data is
     // appropriate (ie: not too large)
-    if (strnlen(fdata, max_file_size) > max_program_size) {
-        Log("Program too large! Bllaarrggghh (make sure it is < 1024 bytes)", 3);
-        exit(-1);
+    if (fdata_len > (size_t)max_program_size) {
+        Log("Program too large! Bllaarrggghh (make sure it is < 1024 bytes)", 2);
+        free(fdata);
+        return false;
     }
 
     // Now, copy fdata into the actual memory
     // and free fdata
-    memcpy(cpu->memory + 0x200, fdata, strnlen(fdata, max_program_size));
-    cpu->memory[0x200 + strnlen(fdata, max_program_size) + 1] = '\0';
+    memcpy(cpu->memory + 0x200, fdata, fdata_len);
+    cpu->memory[0x200 + fdata_len + 1] = '\0';
 
     // Finally, set the appropriate registers and free fdata
-    cpu->program_len = strnlen(fdata, max_program_size);
+    cpu->program_len = fdata_len;
     cpu->pc = 0x200;
     free(fdata);
+    return true;
 }
 
 void cpu_log_io(cpu_t* cpu, char input) {
+    // Put the key in the first free slot (-127 marks free)
     int array_size = sizeof(cpu->io_buff) / sizeof(char);
-    if (array_size < 256) {
-        cpu->io_buff[array_size-1] = input;
+    for (int i = 0; i < array_size; i++) {
+        if (cpu->io_buff[i] == -127) {
+            cpu->io_buff[i] = input;
+            return;
+        }
     }
 }
 
@@ -72,7 +88,20 @@ void cpu_render_to_screen(SDL_Renderer* renderer, cpu_t* cpu) {
         for (size_t j = 0; j < 64; j++) {
             if (cpu->vram[i][j] == true) {
                 SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-                SDL_Rect rect = {i*x_window_scale, j * x_window_scale, x_window_scale, y_window_scale};
+                SDL_Rect rect = {j * x_window_scale, i * y_window_scale, x_window_scale, y_window_scale};
+                SDL_RenderFillRect(renderer, &rect);
+            }
+        }
+    }
+}
+
+void cpu_render_rows(SDL_Renderer* renderer, unsigned long long rows[32]) {
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    for (int i = 0; i < 32; i++) {
+        unsigned long long row = rows[i];
+        for (int j = 0; row != 0; j++, row <<= 1) {
+            if (row >> 63) {
+                SDL_Rect rect = {j * x_window_scale, i * y_window_scale, x_window_scale, y_window_scale};
                 SDL_RenderFillRect(renderer, &rect);
             }
         }
@@ -82,9 +111,10 @@ void cpu_render_to_screen(SDL_Renderer* renderer, cpu_t* cpu) {
 void cpu_instr_cls(cpu_t* cpu) {
     for (size_t i = 0; i < 32; i++) {
         for (size_t j = 0; j < 64; j++) {
-            cpu->vram[i][j] == false;
+            cpu->vram[i][j] = false;
         }
     }
+    cpu->vram_dirty = 0xffffffff;
 }
 
 void cpu_instr_ret(cpu_t* cpu) {
@@ -93,13 +123,14 @@ void cpu_instr_ret(cpu_t* cpu) {
 }
 
 void cpu_instr_jp(cpu_t* cpu, unsigned short addr) {
-    cpu->pc = addr;
+    // cpu_emulate adds 2 after every instruction
+    cpu->pc = addr - 2;
 }
 
 void cpu_instr_call(cpu_t* cpu, unsigned short addr) {
     cpu->sp += 1;
     cpu->stack[cpu->sp] = cpu->pc;
-    cpu->pc = addr;
+    cpu->pc = addr - 2;
 }
 
 void cpu_instr_se(cpu_t* cpu, unsigned char reg, unsigned char byte) {
@@ -199,43 +230,47 @@ void cpu_instr_a(cpu_t* cpu, unsigned short value) {
 }
 
 void cpu_instr_b(cpu_t* cpu, unsigned short addr) {
-    cpu->pc = addr + cpu->reg[0];
+    cpu->pc = addr + cpu->reg[0] - 2;
 }
 
 void cpu_instr_c(cpu_t* cpu, unsigned char reg) {
-    unsigned char rand_byte = rand() % 255;
+    // xorshift32 - same sequence on every run and every thread
+    cpu->rng ^= cpu->rng << 13;
+    cpu->rng ^= cpu->rng >> 17;
+    cpu->rng ^= cpu->rng << 5;
+    unsigned char rand_byte = cpu->rng & 0xff;
     cpu->reg[reg] = rand_byte;
 }
 
 void cpu_instr_d(cpu_t* cpu, unsigned char reg1, unsigned char reg2, unsigned char n) {
-    // load the sprite data
-    unsigned short sprite_start = cpu->I;
-    unsigned char* sprite_data = (unsigned char*)malloc(sizeof(unsigned char) * 18);
-    for (size_t i = sprite_start; i < n; i++) {
-        sprite_data[i] = cpu->memory[i];
-    }
-
-    // actually update vram now
-    for (size_t sprite_byte_index = 0; sprite_byte_index < n; sprite_byte_index++) {
-        for (size_t j = 0; j < 8; j++) {
-            unsigned char bit = sprite_byte_index>>j;
-            if (bit == 0x0 && cpu->vram[cpu->reg[reg1]][cpu->reg[reg2]] == false) {
-                cpu->vram[cpu->reg[reg1]][cpu->reg[reg2]] = false;
-            } else if (bit == 0x1 || cpu->vram[cpu->reg[reg1]][cpu->reg[reg2]] == true) {
-                cpu->vram[cpu->reg[reg1]][cpu->reg[reg2]] = true;
-            } else if (bit == 0x1 && cpu->vram[cpu->reg[reg1]][cpu->reg[reg2]] == true) {
-                cpu->vram[cpu->reg[reg1]][cpu->reg[reg2]] = false;
+    // sprite origin wraps, the sprite itself is clipped at the edges
+    unsigned char x = cpu->reg[reg1] % 64;
+    unsigned char y = cpu->reg[reg2] % 32;
+    cpu->reg[15] = 0;
+
+    // XOR each sprite row into vram, VF = 1 if any pixel got erased
+    for (size_t i = 0; i < n && y + i < 32; i++) {
+        unsigned char sprite_byte = cpu->memory[(cpu->I + i) % cpu->memory_len];
+        for (size_t j = 0; j < 8 && x + j < 64; j++) {
+            if ((sprite_byte >> (7 - j)) & 0x1) {
+                if (cpu->vram[y + i][x + j] == true) {
+                    cpu->reg[15] = 1;
+                }
+                cpu->vram[y + i][x + j] = !cpu->vram[y + i][x + j];
             }
         }
+        if (sprite_byte != 0) {
+            cpu->vram_dirty |= 1u << (y + i);
+        }
     }
-
-    free(sprite_data);
 }
 
 void cpu_instr_skp(cpu_t* cpu, unsigned char reg1) {
     for (size_t i = 0; i < sizeof(cpu->io_buff)/sizeof(char); i++) {
         if (cpu->io_buff[i] == cpu->reg[reg1]) {
+            // skip once, even if the key got logged more than once
             cpu->pc += 2;
+            break;
         }
     }
 }
@@ -260,6 +295,9 @@ void cpu_instr_lddt(cpu_t* cpu, unsigned char reg) {
 }
 
 void cpu_instr_ldio(cpu_t* cpu, unsigned char reg) {
+    if (cpu->headless == true) {
+        return;
+    }
     while (SDL_PollEvent(&(cpu->ev))) {
         switch (cpu->ev.type) {
             case SDL_KEYDOWN:
@@ -342,8 +380,10 @@ void cpu_instr_lddt1(cpu_t* cpu, unsigned char reg) {
 
 void cpu_emulate(cpu_t* cpu) {
     unsigned short instruction = cpu->memory[cpu->pc] << 8 | cpu->memory[cpu->pc+1];
-    Log("Emulating!", 0);
-    printf("\t0x%x\n", instruction);
+    if (cpu_trace == true) {
+        Log("Emulating!", 0);
+        printf("\t0x%x\n", instruction);
+    }
     if (instruction == 0x00E0) {
         // CLS instruction
         cpu_instr_cls(cpu);
@@ -352,10 +392,14 @@ void cpu_emulate(cpu_t* cpu) {
         cpu_instr_ret(cpu);
     } else if (cpu->memory[cpu->pc] >> 4 == 0x1) {
         // jp instruction
-        printf("Loc: 0x%x\n", cpu->memory[cpu->pc] & 0x0f);
-        printf("Loc: 0x%x\n", (cpu->memory[cpu->pc] & 0x0f) << 8);
+        if (cpu_trace == true) {
+            printf("Loc: 0x%x\n", cpu->memory[cpu->pc] & 0x0f);
+            printf("Loc: 0x%x\n", (cpu->memory[cpu->pc] & 0x0f) << 8);
+        }
         unsigned short addr = ((cpu->memory[cpu->pc] & 0x0f) << 8) | cpu->memory[cpu->pc+1];
-        printf("Loc: 0x%x\n", addr);
+        if (cpu_trace == true) {
+            printf("Loc: 0x%x\n", addr);
+        }
         cpu_instr_jp(cpu, addr);
     } else if (cpu->memory[cpu->pc] >> 4 == 0x2) {
         // call instruction
@@ -440,7 +484,7 @@ void cpu_emulate(cpu_t* cpu) {
         cpu_instr_snenotequal(cpu, reg1, reg2);
     } else if (cpu->memory[cpu->pc] >> 4 == 0xa) {
         // a; Set I = nnn 
-        unsigned short val = cpu->memory[cpu->pc] & 0x0f | cpu->memory[cpu->pc+1];
+        unsigned short val = ((cpu->memory[cpu->pc] & 0x0f) << 8) | cpu->memory[cpu->pc+1];
         cpu_instr_a(cpu, val);
     } else if (cpu->memory[cpu->pc] >> 4 == 0xb) {
         // b; jump to location nnn+V0
@@ -471,7 +515,11 @@ void cpu_emulate(cpu_t* cpu) {
     } else if (cpu->memory[cpu->pc] >> 4 == 0xf && cpu->memory[cpu->pc + 1] == 0x0a) {
         // ldio; wait for a key press, store the value in vx
         unsigned char reg = cpu->memory[cpu->pc] & 0x0f;
+        unsigned long long start = metrics_enabled == true ? now_ns() : 0;
         cpu_instr_ldio(cpu, reg);
+        if (metrics_enabled == true) {
+            metrics_record(&metrics.fx0a, now_ns() - start);
+        }
     } else if (cpu->memory[cpu->pc] >> 4 == 0xf && cpu->memory[cpu->pc + 1] == 0x15) {
         // set delay timer = vx;
         unsigned char reg = cpu->memory[cpu->pc] & 0x0f;
@@ -485,3 +533,30 @@ void cpu_emulate(cpu_t* cpu) {
         cpu->time_delay -= 1;
     }
 }
+
+void cpu_emulate_frame(cpu_t* cpu) {
+    cpu->vram_dirty = 0;
+    for (int i = 0; i < cycles_per_frame; i++) {
+        cpu_emulate(cpu);
+    }
+}
+
+void cpu_save_state(cpu_t* cpu, cpu_state_t* state) {
+    state->cpu = *cpu;
+    memcpy(state->memory, cpu->memory, cpu->memory_len);
+}
+
+void cpu_load_state(cpu_t* cpu, cpu_state_t* state) {
+    unsigned char* memory = cpu->memory;
+    *cpu = state->cpu;
+    cpu->memory = memory;
+    memcpy(cpu->memory, state->memory, cpu->memory_len);
+}
+
+unsigned long long cpu_vram_row(cpu_t* cpu, int row) {
+    unsigned long long bits = 0;
+    for (size_t j = 0; j < 64; j++) {
+        bits = (bits << 1) | (cpu->vram[row][j] == true);
+    }
+    return bits;
+}
@@ -19,6 +19,7 @@ typedef struct CPU {
 
     // Video Memory
     bool vram[32][64];
+    unsigned int vram_dirty;        // bit n set = row n changed during the last frame
 
     // General Registers
     unsigned char   reg[16];
@@ -33,10 +34,24 @@ typedef struct CPU {
     // for keyboard input
     char io_buff[256];
 
+    // Random number state for the C instruction. Kept per cpu
+    // so runs are reproducible and cpus can live on different threads
+    unsigned int rng;
+
+    // Headless cpus never touch SDL (regression runs, etc.)
+    bool headless;
+
     // SDL event handler
     SDL_Event ev;
 } cpu_t;
 
+// cpu_state_t - a full copy of a cpu including its memory, for
+// snapshots. It is plain data, so saving and loading never allocates
+typedef struct CPUState {
+    cpu_t cpu;
+    unsigned char memory[4096];     // memory_size can't be more than this
+} cpu_state_t;
+
 // init_cpu - use this to initialize a cpu
 // "object." almost all cpu-related functions
 // require the cpu pointer to not be null, otherwise
@@ -51,10 +66,17 @@ void free_cpu();
 // Currently, I don't have support for ETI 660
 void cpu_load_program(cpu_t* cpu, const char* fname);
 
+// cpu_try_load_program - same, but returns false on error instead of
+// exiting, for callers that have to keep going (other threads, etc.)
+bool cpu_try_load_program(cpu_t* cpu, const char* fname);
+
 // cpu_render_to_screen - this renders everything in vram
 // to the screen
 void cpu_render_to_screen(SDL_Renderer* renderer, cpu_t* cpu);
 
+// cpu_render_rows - same, but from vram packed with cpu_vram_row
+void cpu_render_rows(SDL_Renderer* renderer, unsigned long long rows[32]);
+
 // cpu_log_io - this takes a keyboard input and puts in into the cpu io buffer
 void cpu_log_io(cpu_t* cpu, char input);
 
@@ -98,4 +120,19 @@ void cpu_instr_lddt1(cpu_t* cpu, unsigned char reg);
 // (fetch, decode, execute)
 void cpu_emulate(cpu_t* cpu);
 
+// cpu_emulate_frame - runs cycles_per_frame emulation cycles.
+// vram_dirty is reset at the start, so afterwards it holds exactly
+// the rows that were drawn to during this frame
+void cpu_emulate_frame(cpu_t* cpu);
+
+// cpu_save_state - snapshots the cpu into state
+void cpu_save_state(cpu_t* cpu, cpu_state_t* state);
+
+// cpu_load_state - puts the cpu back the way it was when state was
+// saved. The cpu keeps its own memory buffer
+void cpu_load_state(cpu_t* cpu, cpu_state_t* state);
+
+// cpu_vram_row - packs one row of vram into 64 bits, bit 63 = column 0
+unsigned long long cpu_vram_row(cpu_t* cpu, int row);
+
 #endif // CPU_H
\ No newline at end of file
@@ -0,0 +1,436 @@
+#include "debug.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// registers a condition can look at, after v0-vf
+enum { DEBUG_REG_I = 16, DEBUG_REG_PC, DEBUG_REG_SP, DEBUG_REG_DT, DEBUG_REG_ST };
+enum { DEBUG_OP_EQ, DEBUG_OP_NE, DEBUG_OP_LT, DEBUG_OP_GT, DEBUG_OP_LE, DEBUG_OP_GE };
+
+debugger_t* debug_open(const char* socket_path) {
+    debugger_t* dbg = (debugger_t*)malloc(sizeof(debugger_t));
+    memset(dbg, 0, sizeof(debugger_t));
+    dbg->finish_sp = -1;
+    dbg->listen_fd = -1;
+
+    if (socket_path == NULL) {
+        // The protocol keeps the real stdout. Everything else printed
+        // from here on (logs, stats) goes to stderr, so a script reading
+        // stdout only ever sees protocol lines
+        fflush(stdout);
+        dbg->in_fd = 0;
+        dbg->out = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        return dbg;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    dbg->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (dbg->listen_fd < 0 || bind(dbg->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(dbg->listen_fd, 1) < 0) {
+        Log("Unable to create debugger socket!", 2);
+        if (dbg->listen_fd >= 0) {
+            close(dbg->listen_fd);
+        }
+        free(dbg);
+        return NULL;
+    }
+
+    printf("[Info] Waiting for a debugger on %s\n", socket_path);
+    fflush(stdout);
+    dbg->in_fd = accept(dbg->listen_fd, NULL, NULL);
+    if (dbg->in_fd < 0) {
+        Log("Unable to accept debugger connection!", 2);
+        close(dbg->listen_fd);
+        free(dbg);
+        return NULL;
+    }
+    dbg->out = fdopen(dup(dbg->in_fd), "w");
+    return dbg;
+}
+
+void debug_close(debugger_t* dbg) {
+    for (int i = 0; i < dbg->num_watchpoints; i++) {
+        free(dbg->watchpoints[i].copy);
+    }
+    fclose(dbg->out);
+    if (dbg->listen_fd >= 0) {
+        close(dbg->in_fd);
+        close(dbg->listen_fd);
+    }
+    free(dbg);
+}
+
+static void debug_stop(debugger_t* dbg, cpu_t* cpu, const char* reason) {
+    dbg->paused = true;
+    dbg->step_remaining = 0;
+    dbg->finish_sp = -1;
+    fprintf(dbg->out, "stopped %s pc=0x%03x\n", reason, cpu->pc);
+    fflush(dbg->out);
+}
+
+static unsigned int debug_reg_value(cpu_t* cpu, int reg) {
+    switch (reg) {
+        case DEBUG_REG_I:
+            return cpu->I;
+        case DEBUG_REG_PC:
+            return cpu->pc;
+        case DEBUG_REG_SP:
+            return cpu->sp;
+        case DEBUG_REG_DT:
+            return cpu->time_delay;
+        case DEBUG_REG_ST:
+            return cpu->sound_delay;
+        default:
+            return cpu->reg[reg];
+    }
+}
+
+static bool debug_condition_true(debug_condition_t* cond, cpu_t* cpu) {
+    unsigned int v = debug_reg_value(cpu, cond->reg);
+    switch (cond->op) {
+        case DEBUG_OP_EQ:
+            return v == cond->value;
+        case DEBUG_OP_NE:
+            return v != cond->value;
+        case DEBUG_OP_LT:
+            return v < cond->value;
+        case DEBUG_OP_GT:
+            return v > cond->value;
+        case DEBUG_OP_LE:
+            return v <= cond->value;
+        default:
+            return v >= cond->value;
+    }
+}
+
+int debug_emulate_frame(debugger_t* dbg, cpu_t* cpu) {
+    cpu->vram_dirty = 0;
+    int i;
+    for (i = 0; i < cycles_per_frame && dbg->paused == false; i++) {
+        unsigned short pc = cpu->pc & 0xfff;
+        if (dbg->resuming == false && (dbg->breakpoints[pc >> 6] >> (pc & 63)) & 0x1) {
+            debug_stop(dbg, cpu, "breakpoint");
+            break;
+        }
+        dbg->resuming = false;
+
+        cpu_emulate(cpu);
+
+        // watchpoints - compare against the copy, so any write counts
+        // no matter which instruction did it. Every copy and condition
+        // is brought up to date, but only the first reason is reported
+        char reason[32] = "";
+        for (int w = 0; w < dbg->num_watchpoints; w++) {
+            debug_watchpoint_t* wp = &dbg->watchpoints[w];
+            if (memcmp(wp->copy, cpu->memory + wp->addr, wp->len) != 0) {
+                memcpy(wp->copy, cpu->memory + wp->addr, wp->len);
+                if (reason[0] == '\0') {
+                    snprintf(reason, sizeof(reason), "watch 0x%03x", wp->addr);
+                }
+            }
+        }
+        for (int c = 0; c < dbg->num_conditions; c++) {
+            debug_condition_t* cond = &dbg->conditions[c];
+            bool now = debug_condition_true(cond, cpu);
+            if (now == true && cond->was_true == false && reason[0] == '\0') {
+                snprintf(reason, sizeof(reason), "cond %d", c);
+            }
+            cond->was_true = now;
+        }
+        if (reason[0] == '\0' && dbg->finish_sp >= 0 && cpu->sp < dbg->finish_sp) {
+            snprintf(reason, sizeof(reason), "return");
+        }
+        if (reason[0] == '\0' && dbg->step_remaining > 0 && --dbg->step_remaining == 0) {
+            snprintf(reason, sizeof(reason), "step");
+        }
+        if (reason[0] != '\0') {
+            debug_stop(dbg, cpu, reason);
+        }
+    }
+    return i;
+}
+
+static bool parse_number(const char* s, unsigned int* out) {
+    char* end;
+    if (s == NULL) {
+        return false;
+    }
+    unsigned long v = strtoul(s, &end, 0);
+    if (end == s || *end != '\0') {
+        return false;
+    }
+    *out = v;
+    return true;
+}
+
+static int parse_reg(const char* s) {
+    if (s == NULL) {
+        return -1;
+    }
+    if ((s[0] == 'v' || s[0] == 'V') && s[1] != '\0' && s[2] == '\0') {
+        char* end;
+        long r = strtol(s + 1, &end, 16);
+        return *end == '\0' ? r : -1;
+    }
+    const char* names[] = {"i", "pc", "sp", "dt", "st"};
+    for (int i = 0; i < 5; i++) {
+        if (strcmp(s, names[i]) == 0) {
+            return DEBUG_REG_I + i;
+        }
+    }
+    return -1;
+}
+
+static int parse_op(const char* s) {
+    const char* ops[] = {"==", "!=", "<", ">", "<=", ">="};
+    for (int i = 0; s != NULL && i < 6; i++) {
+        if (strcmp(s, ops[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void debug_command(debugger_t* dbg, cpu_t* cpu, char* line) {
+    char* cmd = strtok(line, " \t\r");
+    char* arg1 = strtok(NULL, " \t\r");
+    char* arg2 = strtok(NULL, " \t\r");
+    char* arg3 = strtok(NULL, " \t\r");
+    unsigned int a, b;
+    FILE* out = dbg->out;
+
+    if (cmd == NULL) {
+        return;
+    } else if (strcmp(cmd, "break") == 0 || strcmp(cmd, "delete") == 0) {
+        if (parse_number(arg1, &a) == false || a >= 4096) {
+            fprintf(out, "error bad address\n");
+        } else {
+            unsigned long long bit = 1ULL << (a & 63);
+            bool set = (dbg->breakpoints[a >> 6] & bit) != 0;
+            if (cmd[0] == 'b' && set == false) {
+                dbg->breakpoints[a >> 6] |= bit;
+                dbg->num_breakpoints++;
+            } else if (cmd[0] == 'd' && set == true) {
+                dbg->breakpoints[a >> 6] &= ~bit;
+                dbg->num_breakpoints--;
+            }
+            fprintf(out, "ok %d breakpoints\n", dbg->num_breakpoints);
+        }
+    } else if (strcmp(cmd, "watch") == 0) {
+        if (parse_number(arg1, &a) == false || parse_number(arg2, &b) == false
+            || b == 0 || a >= (unsigned int)cpu->memory_len || b > (unsigned int)cpu->memory_len - a) {
+            fprintf(out, "error bad range\n");
+        } else if (dbg->num_watchpoints == DEBUG_MAX_WATCHPOINTS) {
+            fprintf(out, "error too many watchpoints\n");
+        } else {
+            debug_watchpoint_t* wp = &dbg->watchpoints[dbg->num_watchpoints++];
+            wp->addr = a;
+            wp->len = b;
+            wp->copy = (unsigned char*)malloc(b);
+            memcpy(wp->copy, cpu->memory + a, b);
+            fprintf(out, "ok %d watchpoints\n", dbg->num_watchpoints);
+        }
+    } else if (strcmp(cmd, "unwatch") == 0) {
+        int found = -1;
+        for (int i = 0; parse_number(arg1, &a) == true && i < dbg->num_watchpoints; i++) {
+            if (dbg->watchpoints[i].addr == a) {
+                found = i;
+            }
+        }
+        if (found < 0) {
+            fprintf(out, "error no such watchpoint\n");
+        } else {
+            free(dbg->watchpoints[found].copy);
+            dbg->watchpoints[found] = dbg->watchpoints[--dbg->num_watchpoints];
+            fprintf(out, "ok %d watchpoints\n", dbg->num_watchpoints);
+        }
+    } else if (strcmp(cmd, "cond") == 0) {
+        int reg = parse_reg(arg1);
+        int op = parse_op(arg2);
+        if (reg < 0 || op < 0 || parse_number(arg3, &a) == false) {
+            fprintf(out, "error usage: cond <reg> <op> <value>\n");
+        } else if (dbg->num_conditions == DEBUG_MAX_CONDITIONS) {
+            fprintf(out, "error too many conditions\n");
+        } else {
+            debug_condition_t* cond = &dbg->conditions[dbg->num_conditions];
+            cond->reg = reg;
+            cond->op = op;
+            cond->value = a;
+            cond->was_true = debug_condition_true(cond, cpu);
+            fprintf(out, "ok cond %d\n", dbg->num_conditions++);
+        }
+    } else if (strcmp(cmd, "uncond") == 0) {
+        dbg->num_conditions = 0;
+        fprintf(out, "ok\n");
+    } else if (strcmp(cmd, "step") == 0) {
+        if (arg1 == NULL) {
+            a = 1;
+        } else if (parse_number(arg1, &a) == false || a == 0) {
+            fprintf(out, "error bad count\n");
+            fflush(out);
+            return;
+        }
+        dbg->step_remaining = a;
+        dbg->paused = false;
+        dbg->resuming = true;
+        fprintf(out, "ok\n");
+    } else if (strcmp(cmd, "finish") == 0) {
+        if (cpu->sp == 0) {
+            fprintf(out, "error not in a subroutine\n");
+        } else {
+            dbg->finish_sp = cpu->sp;
+            dbg->paused = false;
+            dbg->resuming = true;
+            fprintf(out, "ok\n");
+        }
+    } else if (strcmp(cmd, "continue") == 0) {
+        dbg->paused = false;
+        dbg->resuming = true;
+        fprintf(out, "ok\n");
+    } else if (strcmp(cmd, "pause") == 0) {
+        fprintf(out, "ok\n");
+        if (dbg->paused == false) {
+            debug_stop(dbg, cpu, "pause");
+        }
+    } else if (strcmp(cmd, "key") == 0) {
+        if (parse_number(arg1, &a) == false || a > 0xf) {
+            fprintf(out, "error bad key\n");
+        } else {
+            cpu_log_io(cpu, a);
+            fprintf(out, "ok\n");
+        }
+    } else if (strcmp(cmd, "regs") == 0) {
+        fprintf(out, "ok pc=0x%03x sp=%d i=0x%03x dt=%d st=%d", cpu->pc, cpu->sp, cpu->I,
+                cpu->time_delay, cpu->sound_delay);
+        for (int i = 0; i < 16; i++) {
+            fprintf(out, " v%x=0x%02x", i, cpu->reg[i]);
+        }
+        fprintf(out, "\n");
+    } else if (strcmp(cmd, "mem") == 0) {
+        if (parse_number(arg1, &a) == false || parse_number(arg2, &b) == false
+            || a >= (unsigned int)cpu->memory_len || b > (unsigned int)cpu->memory_len - a) {
+            fprintf(out, "error bad range\n");
+        } else {
+            fprintf(out, "ok");
+            for (unsigned int i = 0; i < b; i++) {
+                fprintf(out, " %02x", cpu->memory[a + i]);
+            }
+            fprintf(out, "\n");
+        }
+    } else if (strcmp(cmd, "quit") == 0) {
+        dbg->quit = true;
+        fprintf(out, "ok\n");
+    } else {
+        fprintf(out, "error unknown command %s\n", cmd);
+    }
+    fflush(out);
+}
+
+// debug_line_end - the newline ending the first buffered line, or NULL
+static char* debug_line_end(debugger_t* dbg) {
+    return memchr(dbg->line, '\n', dbg->line_len);
+}
+
+// debug_take_pause - removes the first pause line from anywhere in the
+// buffer, so it isn't stuck behind commands queued while running
+static bool debug_take_pause(debugger_t* dbg) {
+    char* line = dbg->line;
+    char* newline;
+    while ((newline = memchr(line, '\n', dbg->line + dbg->line_len - line)) != NULL) {
+        char* end = newline;
+        while (end > line && (end[-1] == ' ' || end[-1] == '\r' || end[-1] == '\t')) {
+            end--;
+        }
+        if (end - line == 5 && strncmp(line, "pause", 5) == 0) {
+            dbg->line_len -= newline + 1 - line;
+            memmove(line, newline + 1, dbg->line + dbg->line_len - line);
+            return true;
+        }
+        line = newline + 1;
+    }
+    return false;
+}
+
+void debug_poll(debugger_t* dbg, cpu_t* cpu, int timeout_ms) {
+    struct pollfd pfd = {dbg->in_fd, POLLIN, 0};
+    for (;;) {
+        // Buffered commands wait while the cpu runs, so a script can send a
+        // whole session at once. Only pause gets through right away
+        if (dbg->quit == false && dbg->paused == false && debug_take_pause(dbg) == true) {
+            char command[] = "pause";
+            debug_command(dbg, cpu, command);
+        }
+        char* newline;
+        while (dbg->quit == false && dbg->paused == true && (newline = debug_line_end(dbg)) != NULL) {
+            *newline = '\0';
+            char command[sizeof(dbg->line)];
+            strcpy(command, dbg->line);
+            dbg->line_len -= newline + 1 - dbg->line;
+            memmove(dbg->line, newline + 1, dbg->line_len);
+            debug_command(dbg, cpu, command);
+        }
+
+        // The other end is gone. Queued commands only run once the cpu
+        // stops, so wait for that only if something can stop it
+        if (dbg->eof == true && (debug_line_end(dbg) == NULL || debug_active(dbg) == false)) {
+            dbg->quit = true;
+        }
+        if (dbg->quit == true || dbg->eof == true || dbg->line_len == sizeof(dbg->line) - 1) {
+            if (dbg->line_len == sizeof(dbg->line) - 1 && debug_line_end(dbg) == NULL) {
+                // a line that long can't be a command
+                dbg->line_len = 0;
+            }
+            return;
+        }
+
+        if (poll(&pfd, 1, dbg->paused == true ? timeout_ms : 0) <= 0) {
+            return;
+        }
+        ssize_t n = read(dbg->in_fd, dbg->line + dbg->line_len, sizeof(dbg->line) - 1 - dbg->line_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            dbg->eof = true;
+            continue;
+        }
+        dbg->line_len += n;
+    }
+}
+
+int debug_run_headless(const char* program_fname, const char* socket_path) {
+    // Attach first, so the program loader's logs don't end up on stdio
+    cpu_trace = false;
+    debugger_t* dbg = debug_open(socket_path);
+    if (dbg == NULL) {
+        return -1;
+    }
+    cpu_t* cpu = init_cpu();
+    cpu->headless = true;
+    cpu_load_program(cpu, program_fname);
+    debug_stop(dbg, cpu, "start");
+
+    while (dbg->quit == false) {
+        debug_poll(dbg, cpu, dbg->paused ? -1 : 0);
+        if (dbg->paused == true) {
+            continue;
+        }
+        if (debug_active(dbg) == true) {
+            debug_emulate_frame(dbg, cpu);
+        } else {
+            cpu_emulate_frame(cpu);
+        }
+        cpu_flush_io_buffer(cpu);
+    }
+
+    debug_close(dbg);
+    free_cpu(cpu);
+    return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "utils.h"
+#include "cpu.h"
+
+/* Debugger protocol - one command per line, numbers in hex or decimal
+ * (0x prefix for hex):
+ *      break <addr>            stop before executing addr
+ *      delete <addr>           remove a breakpoint
+ *      watch <addr> <len>      stop after anything writes to memory[addr..addr+len)
+ *      unwatch <addr>          remove a watchpoint
+ *      cond <reg> <op> <val>   stop when the condition becomes true. reg is
+ *                              v0-vf, i, pc, sp, dt or st, op is == != < > <= >=
+ *      uncond                  remove all conditions
+ *      step [n]                execute n instructions (default 1)
+ *      finish                  run until the current subroutine returns
+ *      continue                run until something stops it
+ *      pause                   stop right away
+ *      key <k>                 hold key k down for the next frame
+ *      regs                    print the registers
+ *      mem <addr> <len>        hex dump memory
+ *      quit                    detach (headless: exit)
+ * Every command is answered with one line starting with "ok" or "error".
+ * When the cpu stops, "stopped <reason> pc=<addr>" is printed. Commands
+ * sent while the cpu runs are queued until it stops, except pause, which
+ * is handled right away wherever it is in the queue. End of input counts
+ * as quit, once no queued command can still get to run
+*/
+
+#define DEBUG_MAX_WATCHPOINTS 16
+#define DEBUG_MAX_CONDITIONS 16
+
+typedef struct DebugWatchpoint {
+    unsigned short addr;
+    unsigned short len;
+    unsigned char* copy;            // memory as of the last check
+} debug_watchpoint_t;
+
+typedef struct DebugCondition {
+    int reg;                        // 0-15 = v0-vf, see debug.c for the rest
+    int op;
+    unsigned int value;
+    bool was_true;                  // only the false -> true edge stops
+} debug_condition_t;
+
+typedef struct Debugger {
+    // one bit per address
+    unsigned long long breakpoints[4096 / 64];
+    int num_breakpoints;
+
+    debug_watchpoint_t watchpoints[DEBUG_MAX_WATCHPOINTS];
+    int num_watchpoints;
+    debug_condition_t conditions[DEBUG_MAX_CONDITIONS];
+    int num_conditions;
+
+    bool paused;
+    bool resuming;                  // don't re-hit the breakpoint we stopped on
+    unsigned int step_remaining;
+    int finish_sp;                  // -1 unless running to return
+    bool quit;
+    bool eof;                       // no more commands will come in
+
+    int in_fd;
+    FILE* out;
+    int listen_fd;                  // -1 when talking over stdin/stdout
+    char line[256];
+    size_t line_len;
+} debugger_t;
+
+// debug_open - attaches a debugger. If socket_path is NULL the protocol
+// runs over stdin/stdout, otherwise it waits for one client to connect
+// to that Unix domain socket. Returns NULL on error
+debugger_t* debug_open(const char* socket_path);
+
+void debug_close(debugger_t* dbg);
+
+// debug_active - true if anything needs the instrumented loop. When it
+// is false, use cpu_emulate_frame, which knows nothing about debugging
+static inline bool debug_active(debugger_t* dbg) {
+    return dbg->paused || dbg->num_breakpoints > 0 || dbg->num_watchpoints > 0
+        || dbg->num_conditions > 0 || dbg->step_remaining > 0 || dbg->finish_sp >= 0;
+}
+
+// debug_poll - handles any commands that came in, waiting up to
+// timeout_ms for one (-1 = forever, 0 = don't wait)
+void debug_poll(debugger_t* dbg, cpu_t* cpu, int timeout_ms);
+
+// debug_emulate_frame - cpu_emulate_frame with every debugger check
+// between instructions. Does nothing while paused. Returns the number of
+// instructions run
+int debug_emulate_frame(debugger_t* dbg, cpu_t* cpu);
+
+// debug_run_headless - runs a program without a window, paused at the
+// first instruction, under control of the debugger. Returns non-zero on error
+int debug_run_headless(const char* program_fname, const char* socket_path);
+
+#endif // DEBUG_H
@@ -0,0 +1,435 @@
+#include "explore.h"
+#include "regress.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EXPLORE_HASH_SET_LEN (EXPLORE_MAX_STATES * 2)  // power of 2, <= 50% full
+#define EXPLORE_MAX_SCREENS 256
+#define EXPLORE_NO_KEY -1
+#define EXPLORE_START -2               // finding key: before the first frame, no inputs
+
+// explore_trace_t - how a state was reached, one per distinct state
+typedef struct ExploreTrace {
+    unsigned int parent;
+    signed char key;                // EXPLORE_NO_KEY or 0x0-0xf
+} explore_trace_t;
+
+typedef struct ExploreNode {
+    cpu_state_t state;
+    unsigned int trace;
+} explore_node_t;
+
+typedef struct ExploreFinding {
+    unsigned long long id;          // crash: reason and pc, screen: framebuffer hash
+    const char* what;
+    unsigned short pc;
+    unsigned int parent;
+    signed char key;
+    bool found;
+} explore_finding_t;
+
+// explore_range_t - a worker's share of the current level. The owner
+// and thieves both claim items with fetch_add on next
+typedef struct ExploreRange {
+    atomic_uint next;
+    unsigned int end;
+    char pad[56];                   // one range per cache line
+} explore_range_t;
+
+typedef struct Explorer {
+    // lock free set of state hashes, 0 = empty slot
+    _Atomic unsigned long long* states;
+    explore_trace_t* traces;
+    atomic_uint num_traces;
+
+    explore_node_t* frontier;
+    unsigned int frontier_len;
+    explore_range_t* ranges;
+    int num_workers;
+
+    // the next level. Slots are claimed with fetch_add on next_len, so
+    // it never holds more than EXPLORE_MAX_FRONTIER states
+    explore_node_t* next;
+    atomic_uint next_len;
+    atomic_bool truncated;
+
+    pthread_mutex_t findings_lock;
+    explore_finding_t crashes[EXPLORE_MAX_CRASHES];
+    int num_crashes;
+    explore_finding_t screens[EXPLORE_MAX_SCREENS];
+    int num_screens;
+
+    atomic_ullong generated;
+    atomic_ullong duplicates;
+    atomic_bool full;
+    bool last_level;
+    pthread_barrier_t level_start;
+    pthread_barrier_t level_done;
+    bool done;
+} explorer_t;
+
+typedef struct ExploreWorker {
+    explorer_t* ex;
+    int id;
+    cpu_t* cpu;
+} explore_worker_t;
+
+static unsigned long long mix(unsigned long long h, unsigned long long w) {
+    h ^= w;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+// state_hash - everything that decides what the program does next. The io
+// buffer is left out, it's flushed between frames
+static unsigned long long state_hash(cpu_t* cpu) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    h = mix(h, cpu->pc | (unsigned long long)cpu->sp << 16 | (unsigned long long)cpu->I << 32
+               | (unsigned long long)cpu->time_delay << 48 | (unsigned long long)cpu->sound_delay << 56);
+    h = mix(h, cpu->rng);
+    unsigned long long w;
+    for (size_t i = 0; i < sizeof(cpu->stack); i += 8) {
+        memcpy(&w, (unsigned char*)cpu->stack + i, 8);
+        h = mix(h, w);
+    }
+    for (size_t i = 0; i < sizeof(cpu->reg); i += 8) {
+        memcpy(&w, cpu->reg + i, 8);
+        h = mix(h, w);
+    }
+    for (size_t i = 0; i < sizeof(cpu->vram); i += 8) {
+        memcpy(&w, (unsigned char*)cpu->vram + i, 8);
+        h = mix(h, w);
+    }
+    for (int i = 0; i + 8 <= cpu->memory_len; i += 8) {
+        memcpy(&w, cpu->memory + i, 8);
+        h = mix(h, w);
+    }
+    return h != 0 ? h : 1;
+}
+
+// state_set_insert - returns false if the hash was already there
+static bool state_set_insert(explorer_t* ex, unsigned long long h) {
+    unsigned long long mask = EXPLORE_HASH_SET_LEN - 1;
+    for (unsigned long long i = h & mask;; i = (i + 1) & mask) {
+        unsigned long long cur = atomic_load_explicit(&ex->states[i], memory_order_relaxed);
+        if (cur == h) {
+            return false;
+        }
+        if (cur == 0) {
+            unsigned long long empty = 0;
+            if (atomic_compare_exchange_strong(&ex->states[i], &empty, h)) {
+                return true;
+            }
+            if (empty == h) {
+                return false;
+            }
+        }
+    }
+}
+
+// crash_check - called before every instruction
+static const char* crash_check(cpu_t* cpu) {
+    if (cpu->pc + 1 >= cpu->memory_len) {
+        return "pc ran off memory";
+    }
+    unsigned char hi = cpu->memory[cpu->pc];
+    unsigned char lo = cpu->memory[cpu->pc + 1];
+    if (hi >> 4 == 0x2 && cpu->sp >= 15) {
+        return "stack overflow";
+    }
+    if (hi == 0x00 && lo == 0xee && cpu->sp == 0) {
+        return "stack underflow";
+    }
+    return NULL;
+}
+
+static void record_finding(explorer_t* ex, explore_finding_t* f, unsigned int parent, signed char key, unsigned short pc) {
+    // first one wins, and in a breadth first search that's a shortest trace
+    pthread_mutex_lock(&ex->findings_lock);
+    if (f->found == false) {
+        f->found = true;
+        f->parent = parent;
+        f->key = key;
+        f->pc = pc;
+    }
+    pthread_mutex_unlock(&ex->findings_lock);
+}
+
+// check_screens - records every listed screen the cpu is showing
+static void check_screens(explorer_t* ex, cpu_t* cpu, unsigned int parent, signed char key) {
+    if (ex->num_screens == 0) {
+        return;
+    }
+    fb_hash_t fh;
+    fb_hash_init(&fh, cpu);
+    for (int i = 0; i < ex->num_screens; i++) {
+        if (ex->screens[i].id == fh.hash) {
+            record_finding(ex, &ex->screens[i], parent, key, cpu->pc);
+        }
+    }
+}
+
+static void record_crash(explorer_t* ex, const char* what, unsigned short pc, unsigned int parent, signed char key) {
+    pthread_mutex_lock(&ex->findings_lock);
+    unsigned long long id = (unsigned long long)(size_t)what ^ pc;
+    for (int i = 0; i < ex->num_crashes; i++) {
+        if (ex->crashes[i].id == id) {
+            pthread_mutex_unlock(&ex->findings_lock);
+            return;
+        }
+    }
+    if (ex->num_crashes < EXPLORE_MAX_CRASHES) {
+        explore_finding_t* f = &ex->crashes[ex->num_crashes++];
+        f->id = id;
+        f->what = what;
+        f->pc = pc;
+        f->parent = parent;
+        f->key = key;
+        f->found = true;
+    }
+    pthread_mutex_unlock(&ex->findings_lock);
+}
+
+static void expand(explore_worker_t* w, explore_node_t* node) {
+    explorer_t* ex = w->ex;
+    cpu_t* cpu = w->cpu;
+
+    for (int key = EXPLORE_NO_KEY; key < 16; key++) {
+        cpu_load_state(cpu, &node->state);
+        if (key != EXPLORE_NO_KEY) {
+            cpu_log_io(cpu, key);
+        }
+        atomic_fetch_add_explicit(&ex->generated, 1, memory_order_relaxed);
+
+        // cpu_emulate_frame, checking for crashes before each instruction
+        const char* crash = NULL;
+        cpu->vram_dirty = 0;
+        for (int i = 0; i < cycles_per_frame && crash == NULL; i++) {
+            crash = crash_check(cpu);
+            if (crash == NULL) {
+                cpu_emulate(cpu);
+            }
+        }
+        cpu_flush_io_buffer(cpu);
+        if (crash != NULL) {
+            record_crash(ex, crash, cpu->pc, node->trace, key);
+            continue;
+        }
+
+        if (state_set_insert(ex, state_hash(cpu)) == false) {
+            atomic_fetch_add_explicit(&ex->duplicates, 1, memory_order_relaxed);
+            continue;
+        }
+        unsigned int id = atomic_fetch_add(&ex->num_traces, 1);
+        if (id >= EXPLORE_MAX_STATES) {
+            atomic_store(&ex->full, true);
+            continue;
+        }
+        ex->traces[id].parent = node->trace;
+        ex->traces[id].key = key;
+
+        check_screens(ex, cpu, node->trace, key);
+
+        if (ex->last_level == false) {
+            unsigned int slot = atomic_fetch_add_explicit(&ex->next_len, 1, memory_order_relaxed);
+            if (slot >= EXPLORE_MAX_FRONTIER) {
+                atomic_store_explicit(&ex->truncated, true, memory_order_relaxed);
+                continue;
+            }
+            explore_node_t* child = &ex->next[slot];
+            cpu_save_state(cpu, &child->state);
+            child->trace = id;
+        }
+    }
+}
+
+static void* explore_worker(void* arg) {
+    explore_worker_t* w = (explore_worker_t*)arg;
+    explorer_t* ex = w->ex;
+    for (;;) {
+        pthread_barrier_wait(&ex->level_start);
+        if (ex->done == true) {
+            return NULL;
+        }
+
+        // own range first, then steal from the others
+        for (int r = 0; r < ex->num_workers; r++) {
+            explore_range_t* range = &ex->ranges[(w->id + r) % ex->num_workers];
+            for (;;) {
+                unsigned int i = atomic_fetch_add(&range->next, 1);
+                if (i >= range->end) {
+                    break;
+                }
+                expand(w, &ex->frontier[i]);
+            }
+        }
+        pthread_barrier_wait(&ex->level_done);
+    }
+}
+
+static void print_trace(explorer_t* ex, unsigned int parent, signed char key) {
+    if (key == EXPLORE_START) {
+        printf("\tinputs (0 frames): none\n");
+        return;
+    }
+    // walk back to the root, then print in order
+    int len = 0;
+    for (unsigned int t = parent; t != 0; t = ex->traces[t].parent) {
+        len++;
+    }
+    signed char* keys = (signed char*)malloc(len + 1);
+    keys[len] = key;
+    for (unsigned int t = parent, i = len; t != 0; t = ex->traces[t].parent) {
+        keys[--i] = ex->traces[t].key;
+    }
+    printf("\tinputs (%d frames):", len + 1);
+    for (int i = 0; i <= len; i++) {
+        if (keys[i] == EXPLORE_NO_KEY) {
+            printf(" -");
+        } else {
+            printf(" %x", keys[i]);
+        }
+    }
+    printf("\n");
+    free(keys);
+}
+
+static void load_screens(explorer_t* ex, const char* fname) {
+    FILE* fp = fopen(fname, "r");
+    if (fp == NULL) {
+        Log("Unable to open screens file!", 2);
+        return;
+    }
+    char line[256];
+    while (ex->num_screens < EXPLORE_MAX_SCREENS && fgets(line, sizeof(line), fp) != NULL) {
+        int frame;
+        unsigned long long hash;
+        if (line[0] != '#' && sscanf(line, "%d %llx", &frame, &hash) == 2) {
+            ex->screens[ex->num_screens].id = hash;
+            ex->num_screens++;
+        }
+    }
+    fclose(fp);
+}
+
+int explore_run(const char* program_fname, int max_depth, const char* screens_fname) {
+    explorer_t* ex = (explorer_t*)calloc(1, sizeof(explorer_t));
+    ex->states = (_Atomic unsigned long long*)calloc(EXPLORE_HASH_SET_LEN, sizeof(unsigned long long));
+    ex->traces = (explore_trace_t*)malloc(sizeof(explore_trace_t) * EXPLORE_MAX_STATES);
+    pthread_mutex_init(&ex->findings_lock, NULL);
+    if (screens_fname != NULL) {
+        load_screens(ex, screens_fname);
+    }
+
+    // The root state is trace 0
+    cpu_trace = false;
+    cpu_t* root = init_cpu();
+    root->headless = true;
+    cpu_load_program(root, program_fname);
+    state_set_insert(ex, state_hash(root));
+    // expand only sees screens after a frame, the first one is checked here
+    check_screens(ex, root, 0, EXPLORE_START);
+    atomic_init(&ex->num_traces, 1);
+    ex->traces[0].parent = 0;
+    ex->traces[0].key = EXPLORE_NO_KEY;
+    // both levels are allocated once, at the cap
+    ex->frontier = (explore_node_t*)malloc(sizeof(explore_node_t) * EXPLORE_MAX_FRONTIER);
+    ex->next = (explore_node_t*)malloc(sizeof(explore_node_t) * EXPLORE_MAX_FRONTIER);
+    cpu_save_state(root, &ex->frontier[0].state);
+    ex->frontier[0].trace = 0;
+    ex->frontier_len = 1;
+    free_cpu(root);
+
+    ex->num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ex->num_workers < 1) {
+        ex->num_workers = 1;
+    }
+    ex->ranges = (explore_range_t*)calloc(ex->num_workers, sizeof(explore_range_t));
+    pthread_barrier_init(&ex->level_start, NULL, ex->num_workers + 1);
+    pthread_barrier_init(&ex->level_done, NULL, ex->num_workers + 1);
+
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * ex->num_workers);
+    explore_worker_t* workers = (explore_worker_t*)malloc(sizeof(explore_worker_t) * ex->num_workers);
+    for (int i = 0; i < ex->num_workers; i++) {
+        workers[i].ex = ex;
+        workers[i].id = i;
+        workers[i].cpu = init_cpu();
+        workers[i].cpu->headless = true;
+        pthread_create(&threads[i], NULL, explore_worker, &workers[i]);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int depth = 0;
+    while (depth < max_depth && ex->frontier_len > 0 && atomic_load(&ex->full) == false) {
+        // split the level into one range per worker
+        for (int i = 0; i < ex->num_workers; i++) {
+            atomic_store(&ex->ranges[i].next, ex->frontier_len * (unsigned long long)i / ex->num_workers);
+            ex->ranges[i].end = ex->frontier_len * (unsigned long long)(i + 1) / ex->num_workers;
+        }
+        atomic_store(&ex->next_len, 0);
+        ex->last_level = depth + 1 == max_depth;
+        pthread_barrier_wait(&ex->level_start);
+        pthread_barrier_wait(&ex->level_done);
+        depth++;
+
+        // the next level becomes the frontier
+        unsigned int n = atomic_load(&ex->next_len);
+        explore_node_t* swap = ex->frontier;
+        ex->frontier = ex->next;
+        ex->next = swap;
+        ex->frontier_len = n < EXPLORE_MAX_FRONTIER ? n : EXPLORE_MAX_FRONTIER;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ex->done = true;
+    pthread_barrier_wait(&ex->level_start);
+    for (int i = 0; i < ex->num_workers; i++) {
+        pthread_join(threads[i], NULL);
+        free_cpu(workers[i].cpu);
+    }
+
+    // Report
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    unsigned long long generated = atomic_load(&ex->generated);
+    unsigned long long duplicates = atomic_load(&ex->duplicates);
+    unsigned int states = atomic_load(&ex->num_traces);
+    if (states > EXPLORE_MAX_STATES) {
+        states = EXPLORE_MAX_STATES;
+    }
+    printf("explored %d frames deep on %d threads in %.2fs\n", depth, ex->num_workers, seconds);
+    printf("%u distinct states, %llu generated, %.0f states/s, dedupe ratio %.1f%%\n",
+           states, generated, seconds > 0 ? generated / seconds : 0.0,
+           generated > 0 ? 100.0 * duplicates / generated : 0.0);
+    if (atomic_load(&ex->truncated) == true || atomic_load(&ex->full) == true) {
+        printf("search was cut short (frontier or state limit), results are not exhaustive\n");
+    }
+    for (int i = 0; i < ex->num_crashes; i++) {
+        printf("crash: %s at pc=0x%03x\n", ex->crashes[i].what, ex->crashes[i].pc);
+        print_trace(ex, ex->crashes[i].parent, ex->crashes[i].key);
+    }
+    for (int i = 0; i < ex->num_screens; i++) {
+        if (ex->screens[i].found == true) {
+            printf("screen %016llx: reached\n", ex->screens[i].id);
+            print_trace(ex, ex->screens[i].parent, ex->screens[i].key);
+        } else {
+            printf("screen %016llx: never reached\n", ex->screens[i].id);
+        }
+    }
+
+    int crashes = ex->num_crashes;
+    pthread_barrier_destroy(&ex->level_start);
+    pthread_barrier_destroy(&ex->level_done);
+    pthread_mutex_destroy(&ex->findings_lock);
+    free(threads);
+    free(workers);
+    free(ex->ranges);
+    free(ex->next);
+    free(ex->frontier);
+    free(ex->traces);
+    free((void*)ex->states);
+    free(ex);
+    return crashes;
+}
@@ -0,0 +1,27 @@
+#ifndef EXPLORE_H
+#define EXPLORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "utils.h"
+#include "cpu.h"
+
+#define EXPLORE_MAX_STATES (1 << 22)    // distinct states remembered
+#define EXPLORE_MAX_FRONTIER 20000      // states kept per frame, ~6.5KB each, two frames at once
+#define EXPLORE_MAX_CRASHES 32
+
+// explore_run - breadth first search over everything a program can do in
+// max_depth frames, branching on "no key" and each of the 16 keys at every
+// frame boundary. States are deduplicated by a hash of the whole cpu, and
+// every level is spread across all cores.
+//
+// Reports crashes (pc running off memory, stack over/underflow) and, if
+// screens_fname is given, which of the screens listed in it were reached.
+// That file uses the regression checkpoint format ("<frame> <hash>", the
+// frame column is ignored). Every finding comes with the shortest input
+// trace that gets there. Returns the number of crashes found
+int explore_run(const char* program_fname, int max_depth, const char* screens_fname);
+
+#endif // EXPLORE_H
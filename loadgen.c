@@ -0,0 +1,164 @@
+// loadgen - local load generator for the emulator server (see server.h).
+// Opens many client connections, presses keys on each of them and
+// measures input-to-frame latency: the time from sending an input to
+// receiving the first frame that was emulated with it.
+//
+//      cc -O2 -o loadgen loadgen.c utils.c logger.c
+//      ./loadgen <socket path> <clients> <seconds>
+
+#include "server.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define LOADGEN_INPUT_INTERVAL_NS 100000000ULL  // 10 inputs a second per client
+
+typedef struct LoadgenClient {
+    int fd;
+    unsigned int seq;
+    bool waiting;                   // input sent, frame not seen yet
+    bool pressed;
+    unsigned long long sent_ns;
+    unsigned long long next_input_ns;
+    unsigned long long frames;
+    unsigned long long rows[32];
+
+    unsigned char in[4096];
+    size_t in_len;
+} loadgen_client_t;
+
+static int compare_ull(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        printf("Usage: %s <socket path> <clients> <seconds>\n", argv[0]);
+        return -1;
+    }
+    int num_clients = atoi(argv[2]);
+    unsigned long long duration_ns = atoi(argv[3]) * 1000000000ULL;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+
+    loadgen_client_t* clients = (loadgen_client_t*)calloc(num_clients, sizeof(loadgen_client_t));
+    struct pollfd* fds = (struct pollfd*)calloc(num_clients, sizeof(struct pollfd));
+    unsigned long long start = now_ns();
+    for (int i = 0; i < num_clients; i++) {
+        clients[i].fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(clients[i].fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            printf("[Fatal] Unable to connect client %d: %s\n", i, strerror(errno));
+            return -1;
+        }
+        // spread the inputs out over the interval
+        clients[i].next_input_ns = start + LOADGEN_INPUT_INTERVAL_NS * i / num_clients;
+        fds[i].fd = clients[i].fd;
+        fds[i].events = POLLIN;
+    }
+
+    size_t latencies_cap = 1024;
+    size_t num_latencies = 0;
+    unsigned long long* latencies = (unsigned long long*)malloc(sizeof(unsigned long long) * latencies_cap);
+
+    unsigned long long now = start;
+    while (now - start < duration_ns) {
+        poll(fds, num_clients, 1);
+        now = now_ns();
+
+        for (int i = 0; i < num_clients; i++) {
+            loadgen_client_t* c = &clients[i];
+
+            if (fds[i].revents & POLLIN) {
+                ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+                if (n <= 0) {
+                    printf("[Fatal] Server closed client %d\n", i);
+                    return -1;
+                }
+                c->in_len += n;
+
+                // Parse every complete frame update
+                size_t pos = 0;
+                while (c->in_len - pos >= SERVER_FRAME_HEADER_LEN) {
+                    unsigned char* msg = c->in + pos;
+                    unsigned int mask = get_u32(msg + 9);
+                    size_t len = SERVER_FRAME_HEADER_LEN + __builtin_popcount(mask) * 8;
+                    if (c->in_len - pos < len) {
+                        break;
+                    }
+                    unsigned char* row = msg + SERVER_FRAME_HEADER_LEN;
+                    for (int r = 0; r < 32; r++) {
+                        if (mask & (1u << r)) {
+                            c->rows[r] = 0;
+                            for (int j = 0; j < 8; j++) {
+                                c->rows[r] = (c->rows[r] << 8) | *row++;
+                            }
+                        }
+                    }
+                    c->frames++;
+
+                    if (c->waiting == true && get_u32(msg + 5) == c->seq) {
+                        if (num_latencies == latencies_cap) {
+                            latencies_cap *= 2;
+                            latencies = (unsigned long long*)realloc(latencies, sizeof(unsigned long long) * latencies_cap);
+                        }
+                        latencies[num_latencies++] = now - c->sent_ns;
+                        c->waiting = false;
+                    }
+                    pos += len;
+                }
+                memmove(c->in, c->in + pos, c->in_len - pos);
+                c->in_len -= pos;
+            }
+
+            // Alternate pressing and releasing a key
+            if (c->waiting == false && now >= c->next_input_ns) {
+                unsigned char msg[SERVER_INPUT_LEN];
+                c->seq++;
+                c->pressed = !c->pressed;
+                msg[0] = c->pressed ? 'P' : 'R';
+                msg[1] = (c->seq / 2) % 16;
+                put_u32(msg + 2, c->seq);
+                if (write(c->fd, msg, sizeof(msg)) != sizeof(msg)) {
+                    printf("[Fatal] Unable to send input on client %d\n", i);
+                    return -1;
+                }
+                c->waiting = true;
+                c->sent_ns = now;
+                c->next_input_ns += LOADGEN_INPUT_INTERVAL_NS;
+                if (c->next_input_ns < now) {
+                    c->next_input_ns = now + LOADGEN_INPUT_INTERVAL_NS;
+                }
+            }
+        }
+    }
+
+    unsigned long long frames = 0;
+    for (int i = 0; i < num_clients; i++) {
+        frames += clients[i].frames;
+        close(clients[i].fd);
+    }
+    double seconds = (now - start) / 1e9;
+    printf("%d clients, %.1f frame updates/s per client\n", num_clients, frames / seconds / num_clients);
+
+    if (num_latencies > 0) {
+        qsort(latencies, num_latencies, sizeof(unsigned long long), compare_ull);
+        printf("input-to-frame latency over %zu inputs: p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n",
+               num_latencies,
+               latencies[num_latencies / 2] / 1e6,
+               latencies[num_latencies * 9 / 10] / 1e6,
+               latencies[num_latencies * 99 / 100] / 1e6,
+               latencies[num_latencies - 1] / 1e6);
+    }
+
+    free(latencies);
+    free(fds);
+    free(clients);
+    return 0;
+}
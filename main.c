@@ -3,17 +3,144 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
 #include "utils.h"
 #include "cpu.h"
+#include "regress.h"
+#include "record.h"
+#include "server.h"
+#include "pipeline.h"
+#include "debug.h"
+#include "explore.h"
+#include "shm.h"
+#include "metrics.h"
 
 int main(int argc, char** argv) {
     // Check if we have valid arguments
     if (argc < 2) {
         Log("Incorrect usage!", 3);
-        printf("\tCorrect usage: ./a.out <program file name>\n");
+        printf("\tCorrect usage: ./a.out <program file name> [--record <recording>] [--runahead <frames>] [--threaded] [--debug [socket path]] [--shm <name>] [--metrics [stats file]]\n");
+        printf("\t               ./a.out --regress <suite file>\n");
+        printf("\t               ./a.out --latency <program file name> <key> <frame> [max run-ahead frames] [expected frames]\n");
+        printf("\t               ./a.out --play <recording> [start frame]\n");
+        printf("\t               ./a.out --export <recording> <video.y4m>\n");
+        printf("\t               ./a.out --server <socket path> <program file name>\n");
+        printf("\t               ./a.out --debug <program file name> [socket path]\n");
+        printf("\t               ./a.out --shm-bench <program file name> [seconds]\n");
+        printf("\t               ./a.out --explore <program file name> <frames> [screens file]\n");
         return -1;
     }
-    
+
+    // Headless regression run, no window needed
+    if (strcmp(argv[1], "--regress") == 0) {
+        if (argc < 3) {
+            Log("Missing regression suite file!", 3);
+            return -1;
+        }
+        return regress_run_suite(argv[2]) == 0 ? 0 : 1;
+    }
+
+    // Frames from key press to screen change, for each run-ahead setting
+    if (strcmp(argv[1], "--latency") == 0) {
+        if (argc < 5) {
+            Log("Missing program file, key or frame!", 3);
+            return -1;
+        }
+        int max_run_ahead = argc > 5 ? atoi(argv[5]) : 0;
+        int expected = argc > 6 ? atoi(argv[6]) : -1;
+        return regress_measure_latency(argv[2], strtol(argv[3], NULL, 16), atoi(argv[4]),
+                                       max_run_ahead, expected) == 0 ? 0 : 1;
+    }
+
+    // Recording to video, no window needed either
+    if (strcmp(argv[1], "--export") == 0) {
+        if (argc < 4) {
+            Log("Missing recording or video file!", 3);
+            return -1;
+        }
+        return record_export_y4m(argv[2], argv[3]) == true ? 0 : 1;
+    }
+
+    // Debugger without a window, for scripts
+    if (strcmp(argv[1], "--debug") == 0) {
+        if (argc < 3) {
+            Log("Missing program file!", 3);
+            return -1;
+        }
+        return debug_run_headless(argv[2], argc > 3 ? argv[3] : NULL);
+    }
+
+    // Search every input sequence for crashes and screens
+    if (strcmp(argv[1], "--explore") == 0) {
+        if (argc < 4) {
+            Log("Missing program file or frame count!", 3);
+            return -1;
+        }
+        return explore_run(argv[2], atoi(argv[3]), argc > 4 ? argv[4] : NULL) == 0 ? 0 : 1;
+    }
+
+    // Cost of the shared memory export with a reader polling it
+    if (strcmp(argv[1], "--shm-bench") == 0) {
+        if (argc < 3) {
+            Log("Missing program file!", 3);
+            return -1;
+        }
+        return shm_benchmark(argv[2], argc > 3 ? atoi(argv[3]) : 4);
+    }
+
+    // Multi-session server, also headless
+    if (strcmp(argv[1], "--server") == 0) {
+        if (argc < 4) {
+            Log("Missing socket path or program file!", 3);
+            return -1;
+        }
+        return server_run(argv[2], argv[3]);
+    }
+
+    // Optional flags after the program file
+    const char* record_fname = NULL;
+    int run_ahead = 0;
+    bool threaded = false;
+    bool debugging = false;
+    const char* debug_socket = NULL;
+    const char* shm_name = NULL;
+    bool metrics_on = false;
+    const char* metrics_fname = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_fname = argv[++i];
+        } else if (strcmp(argv[i], "--runahead") == 0 && i + 1 < argc) {
+            run_ahead = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            metrics_on = true;
+            if (i + 1 < argc && strncmp(argv[i+1], "--", 2) != 0) {
+                metrics_fname = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--threaded") == 0) {
+            threaded = true;
+        } else if (strcmp(argv[i], "--debug") == 0) {
+            debugging = true;
+            if (i + 1 < argc && strncmp(argv[i+1], "--", 2) != 0) {
+                debug_socket = argv[++i];
+            }
+        }
+    }
+
+    // The debugger has to run on the same thread as the cpu. It is attached
+    // before anything else prints, stdio debugging moves all other output
+    // to stderr
+    debugger_t* dbg = NULL;
+    if (debugging == true) {
+        if (threaded == true) {
+            Log("Can't debug in threaded mode, running single threaded", 1);
+            threaded = false;
+        }
+        cpu_trace = false;
+        dbg = debug_open(debug_socket);
+    }
+
     // Set up SDL Window
     SDL_Window* window = NULL;
     window = SDL_CreateWindow("Chip8",
@@ -32,6 +159,47 @@ int main(int argc, char** argv) {
     renderer = SDL_CreateRenderer(window, -1,
                 SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
+    // Playback of a recording instead of running a program
+    if (strcmp(argv[1], "--play") == 0) {
+        player_t* player = argc > 2 ? player_open(argv[2]) : NULL;
+        if (player == NULL) {
+            Log("Unable to play recording!", 3);
+            return -1;
+        }
+        if (argc > 3 && player_seek(player, atoi(argv[3])) == false) {
+            Log("Recording is shorter than the start frame!", 3);
+            player_close(player);
+            return -1;
+        }
+        bool playing = true;
+        SDL_Event ev;
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        while (playing == true && player_next_frame(player) == true) {
+            while (SDL_PollEvent(&ev)) {
+                if (ev.type == SDL_QUIT || (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_ESCAPE)) {
+                    playing = false;
+                }
+            }
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+            SDL_RenderClear(renderer);
+            player_render(renderer, player);
+            SDL_RenderPresent(renderer);
+
+            // at the speed it was recorded, whatever the display refresh rate
+            deadline.tv_nsec += RECORD_FRAME_NS;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        }
+        player_close(player);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        return 0;
+    }
+
     // Initialize CPU, memory, and registers
     Log("Initializing CPU, memory, and registers...", 0);
     cpu_t* cpu = init_cpu();
@@ -42,24 +210,46 @@ int main(int argc, char** argv) {
     cpu_load_program(cpu, argv[1]);
     Log("Program loaded!", 0);
 
-    // Test Graphics
-    for (size_t i = 0; i < 32; i++) {
-        for (size_t j = 0; j < 64; j++) {
-            cpu->vram[i][j] = false;
-            if (i == 2 && j == 2) {
-                cpu->vram[i][j] = true;
-            } else if (i == 2 && j == 3) {
-                cpu->vram[i][j] = true;
-            } else if (i == 3 && j == 4) {
-                cpu->vram[i][j] = true;
-            }
-        }
+    // Start recording if asked to
+    recorder_t* rec = NULL;
+    if (record_fname != NULL) {
+        rec = recorder_open(record_fname);
+    }
+
+    // Export frames and registers to shared memory if asked to
+    shm_export_t* shm = NULL;
+    if (shm_name != NULL) {
+        shm = shm_export_open(shm_name);
     }
 
     // Execute the program
-    printf("0x%x\n", cpu->memory[0x218]);
+    if (cpu_trace == true) {
+        printf("0x%x\n", cpu->memory[0x218]);
+    }
     Log("Starting execution...", 0);
 
+    // Run-ahead snapshot and its cost
+    cpu_state_t run_ahead_state;
+    Uint64 run_ahead_ticks = 0;
+    Uint64 run_ahead_frames = 0;
+
+    // Timers and counters, before any frame is emulated
+    if (metrics_on == true) {
+        metrics_start(metrics_fname);
+    }
+
+    // Emulate on a separate thread if asked to
+    pipeline_t* pipeline = NULL;
+    if (threaded == true) {
+        pipeline = pipeline_start(cpu, rec, shm, run_ahead);
+        if (pipeline == NULL) {
+            Log("Running single-threaded instead", 1);
+        }
+    }
+    frame_stats_t present_stats;
+    memset(&present_stats, 0, sizeof(present_stats));
+    unsigned long long input_ns = 0;    // oldest key not on screen yet (metrics)
+
     // Mainloop
     bool running = true;
     SDL_Event ev;
@@ -70,93 +260,200 @@ int main(int argc, char** argv) {
                     if (ev.key.keysym.sym == SDLK_ESCAPE) {
                         running = false;
                     }
+                    int key = -1;
                     switch (ev.key.keysym.sym) {
                         case SDLK_x:
                             // map to "0" key
-                            cpu_log_io(cpu, 0x0);
+                            key = 0x0;
                             break;
                         case SDLK_1:
                             // map to "1" key
-                            cpu_log_io(cpu, 0x1);
+                            key = 0x1;
                             break;
                         case SDLK_2:
                             // map to "2" key
-                            cpu_log_io(cpu, 0x2);
+                            key = 0x2;
                             break;
                         case SDLK_3:
                             // map to "3" key
-                            cpu_log_io(cpu, 0x3);
+                            key = 0x3;
                             break;
                         case SDLK_4:
                             // map to "c" key
-                            cpu_log_io(cpu, 0xc);
+                            key = 0xc;
                             break;
                         case SDLK_q:
                             // map to "4" key
-                            cpu_log_io(cpu, 0x4);
+                            key = 0x4;
                             break;
                         case SDLK_w:
                             // map to "5" key
-                            cpu_log_io(cpu, 0x5);
+                            key = 0x5;
                             break;
                         case SDLK_e:
                             // map to "6" key
-                            cpu_log_io(cpu, 0x6);
+                            key = 0x6;
                             break;
                         case SDLK_r:
                             // map to "d" key
-                            cpu_log_io(cpu, 0xd);
+                            key = 0xd;
                             break;
                         case SDLK_a:
                             // map to "7" key
-                            cpu_log_io(cpu, 0x7);
+                            key = 0x7;
                             break;
                         case SDLK_s:
                             // map to "8" key
-                            cpu_log_io(cpu, 0x8);
+                            key = 0x8;
                             break;
                         case SDLK_d:
                             // map to "9" key
-                            cpu_log_io(cpu, 0x9);
+                            key = 0x9;
                             break;
                         case SDLK_f:
                             // map to "e" key
-                            cpu_log_io(cpu, 0xe);
+                            key = 0xe;
                             break;
                         case SDLK_z:
                             // map to "a" key
-                            cpu_log_io(cpu, 0xa);
+                            key = 0xa;
                             break;
                         case SDLK_c:
                             // map to "b" key
-                            cpu_log_io(cpu, 0xb);
+                            key = 0xb;
                             break;
                         case SDLK_v:
                             // map to "f" key
-                            cpu_log_io(cpu, 0xf);
+                            key = 0xf;
                             break;
                     }
+                    if (key >= 0 && pipeline != NULL) {
+                        pipeline_push_key(pipeline, key);
+                    } else if (key >= 0) {
+                        cpu_log_io(cpu, key);
+                        if (metrics_enabled == true && input_ns == 0) {
+                            input_ns = now_ns();
+                        }
+                    }
+                    break;
                 case SDL_QUIT:
                     running = false;
             }
         }
 
-        // Loop operations here
-        cpu_emulate(cpu);
-        cpu_flush_io_buffer(cpu);
-        printf("0x%x\n", cpu->pc);
+        // Pipelined - the emulation thread does the work,
+        // just show the newest frame it finished
+        if (pipeline != NULL) {
+            frame_buffer_t* fb = pipeline_latest_frame(pipeline);
+            unsigned long long start = metrics_enabled == true ? now_ns() : 0;
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+            SDL_RenderClear(renderer);
+            cpu_render_rows(renderer, fb->rows);
+            SDL_RenderPresent(renderer);
+            frame_stats_tick(&pipeline->present_stats);
+            if (metrics_enabled == true) {
+                unsigned long long end = now_ns();
+                metrics_record(&metrics.present, end - start);
+                if (fb->input_ns != 0) {
+                    metrics_record(&metrics.input, end - fb->input_ns);
+                    fb->input_ns = 0;
+                }
+            }
+            continue;
+        }
+
+        // Loop operations here. The instrumented loop is only
+        // used while the debugger has something to check
+        if (dbg != NULL) {
+            debug_poll(dbg, cpu, 0);
+            if (dbg->quit == true) {
+                debug_close(dbg);
+                dbg = NULL;
+            }
+        }
+        unsigned long long start = metrics_enabled == true ? now_ns() : 0;
+        int instructions = cycles_per_frame;
+        if (dbg != NULL && debug_active(dbg) == true) {
+            instructions = debug_emulate_frame(dbg, cpu);
+        } else {
+            cpu_emulate_frame(cpu);
+        }
+        if (metrics_enabled == true) {
+            metrics_record(&metrics.emulate, now_ns() - start);
+            metrics_count(&metrics.instructions, instructions);
+        }
+        if (rec != NULL) {
+            recorder_frame(rec, cpu);
+        }
+        if (shm != NULL) {
+            shm_export_frame(shm, cpu);
+        }
+        if (cpu_trace == true) {
+            printf("0x%x\n", cpu->pc);
+        }
+
+        // Run ahead - emulate a few frames into the future with the
+        // keys currently down and show that, then go back afterwards
+        if (run_ahead > 0) {
+            Uint64 start = SDL_GetPerformanceCounter();
+            cpu_save_state(cpu, &run_ahead_state);
+            // Fx0A would eat SDL events in frames that get thrown away
+            cpu->headless = true;
+            for (int i = 0; i < run_ahead; i++) {
+                cpu_emulate_frame(cpu);
+            }
+            cpu->headless = false;
+            run_ahead_ticks += SDL_GetPerformanceCounter() - start;
+        }
 
         // Render here
+        start = metrics_enabled == true ? now_ns() : 0;
         SDL_RenderClear(renderer);
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
         SDL_Rect rect = {0, 0, x_window_scale * 64, y_window_scale * 32};
         SDL_RenderFillRect(renderer, &rect);
         cpu_render_to_screen(renderer, cpu);
         SDL_RenderPresent(renderer);
+        frame_stats_tick(&present_stats);
+        if (metrics_enabled == true) {
+            unsigned long long end = now_ns();
+            metrics_record(&metrics.present, end - start);
+            if (input_ns != 0) {
+                metrics_record(&metrics.input, end - input_ns);
+                input_ns = 0;
+            }
+        }
+
+        if (run_ahead > 0) {
+            Uint64 start = SDL_GetPerformanceCounter();
+            cpu_load_state(cpu, &run_ahead_state);
+            run_ahead_ticks += SDL_GetPerformanceCounter() - start;
+            run_ahead_frames++;
+        }
+        cpu_flush_io_buffer(cpu);
     }
 
     // Cleanup
+    if (pipeline != NULL) {
+        pipeline_stop(pipeline);
+    } else {
+        frame_stats_print("Single-threaded frame", &present_stats);
+    }
+    if (run_ahead_frames > 0) {
+        printf("[Info] Run-ahead of %d frames cost %.1fus per frame\n", run_ahead,
+               run_ahead_ticks * 1000000.0 / SDL_GetPerformanceFrequency() / run_ahead_frames);
+    }
+    metrics_stop();
     Log("Cleaning up...", 0);
+    if (dbg != NULL) {
+        debug_close(dbg);
+    }
+    if (rec != NULL) {
+        recorder_close(rec);
+    }
+    if (shm != NULL) {
+        shm_export_close(shm);
+    }
     free_cpu(cpu);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
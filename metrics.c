@@ -0,0 +1,180 @@
+#include "metrics.h"
+#include <pthread.h>
+
+metrics_t metrics = {
+    .emulate = {"chip8_frame_emulate_seconds", "Time to emulate one frame."},
+    .present = {"chip8_frame_present_seconds", "Time to render and present one frame."},
+    .input = {"chip8_input_latency_seconds", "Time from a key event to the first frame using it on screen."},
+    .fx0a = {"chip8_fx0a_wait_seconds", "Time spent in each Fx0A (wait for key) instruction."},
+};
+bool metrics_enabled = false;
+
+static const char* metrics_fname = NULL;
+static unsigned long long metrics_start_ns;
+static unsigned long long last_write_ns;
+static unsigned long long last_instructions;
+static pthread_t metrics_thread;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metrics_cond = PTHREAD_COND_INITIALIZER;
+static bool metrics_stopping = false;
+
+static unsigned long long bucket_lower(int i) {
+    if (i < (1 << METRICS_SUB_BITS)) {
+        return i;
+    }
+    int group = i >> METRICS_SUB_BITS;
+    int e = group + METRICS_SUB_BITS - 1;
+    unsigned long long m = i & ((1 << METRICS_SUB_BITS) - 1);
+    return ((1ULL << METRICS_SUB_BITS) + m) << (e - METRICS_SUB_BITS);
+}
+
+static unsigned long long bucket_upper(int i) {
+    return i + 1 < METRICS_BUCKETS ? bucket_lower(i + 1) : ~0ULL;
+}
+
+// snapshot - copies the buckets once so the counts written are consistent
+static unsigned long long snapshot(metrics_histogram_t* hist, unsigned long long* buckets) {
+    unsigned long long count = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        buckets[i] = atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+        count += buckets[i];
+    }
+    return count;
+}
+
+static void write_counter(FILE* fp, const char* name, const char* help, const char* type, double value) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+static void write_histogram(FILE* fp, metrics_histogram_t* hist) {
+    unsigned long long buckets[METRICS_BUCKETS];
+    unsigned long long count = snapshot(hist, buckets);
+    fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", hist->name, hist->help, hist->name);
+
+    // Prometheus only gets the powers of two from ~1us to ~17s,
+    // the fine buckets are for the summary
+    unsigned long long cumulative = 0;
+    int i = 0;
+    for (int k = 10; k <= 34; k++) {
+        for (; i < METRICS_BUCKETS && bucket_upper(i) <= (1ULL << k); i++) {
+            cumulative += buckets[i];
+        }
+        fprintf(fp, "%s_bucket{le=\"%.9g\"} %llu\n", hist->name, (1ULL << k) / 1e9, cumulative);
+    }
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", hist->name, count);
+    fprintf(fp, "%s_sum %.9g\n", hist->name,
+            atomic_load_explicit(&hist->sum_ns, memory_order_relaxed) / 1e9);
+    fprintf(fp, "%s_count %llu\n", hist->name, count);
+}
+
+static void write_file() {
+    unsigned long long now = now_ns();
+    unsigned long long instructions = atomic_load_explicit(&metrics.instructions, memory_order_relaxed);
+    double ips = now > last_write_ns ? (instructions - last_instructions) / ((now - last_write_ns) / 1e9) : 0;
+    last_write_ns = now;
+    last_instructions = instructions;
+
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_fname);
+    FILE* fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        Log("Unable to write metrics file!", 2);
+        return;
+    }
+    write_counter(fp, "chip8_instructions_total", "Instructions emulated.", "counter", instructions);
+    write_counter(fp, "chip8_instructions_per_second", "Instructions emulated per second since the last write.", "gauge", ips);
+    write_counter(fp, "chip8_dropped_frames_total", "Frames emulated but never presented (threaded mode).", "counter",
+                  atomic_load_explicit(&metrics.dropped_frames, memory_order_relaxed));
+    write_histogram(fp, &metrics.emulate);
+    write_histogram(fp, &metrics.present);
+    write_histogram(fp, &metrics.input);
+    write_histogram(fp, &metrics.fx0a);
+    fclose(fp);
+    rename(tmp, metrics_fname);
+}
+
+static void* metrics_writer(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&metrics_lock);
+    while (metrics_stopping == false) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += METRICS_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (METRICS_INTERVAL_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&metrics_cond, &metrics_lock, &deadline);
+        if (metrics_stopping == false) {
+            write_file();
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    return NULL;
+}
+
+void metrics_start(const char* fname) {
+    metrics_enabled = true;
+    metrics_start_ns = now_ns();
+    last_write_ns = metrics_start_ns;
+    last_instructions = atomic_load(&metrics.instructions);
+    metrics_fname = fname;
+    if (fname != NULL && pthread_create(&metrics_thread, NULL, metrics_writer, NULL) != 0) {
+        Log("Unable to start metrics writer!", 2);
+        metrics_fname = NULL;
+    }
+}
+
+static void print_histogram(const char* label, metrics_histogram_t* hist) {
+    unsigned long long buckets[METRICS_BUCKETS];
+    unsigned long long count = snapshot(hist, buckets);
+    if (count == 0) {
+        return;
+    }
+
+    // the middle of the bucket each percentile falls in
+    const double quantiles[] = {0.5, 0.99, 0.999};
+    double values[3];
+    double max = 0;
+    unsigned long long cumulative = 0;
+    int q = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        cumulative += buckets[i];
+        double mid = (bucket_lower(i) + (bucket_upper(i) - bucket_lower(i)) / 2.0) / 1e3;
+        for (; q < 3 && cumulative >= quantiles[q] * count; q++) {
+            values[q] = mid;
+        }
+        max = bucket_upper(i) / 1e3;
+    }
+    printf("[Info] Metrics: %s: %llu samples, %.1fus mean, %.1fus p50, %.1fus p99, %.1fus p99.9, <%.1fus max\n",
+           label, count, atomic_load(&hist->sum_ns) / 1e3 / count, values[0], values[1], values[2], max);
+}
+
+void metrics_stop() {
+    if (metrics_enabled == false) {
+        return;
+    }
+    if (metrics_fname != NULL) {
+        pthread_mutex_lock(&metrics_lock);
+        metrics_stopping = true;
+        pthread_cond_signal(&metrics_cond);
+        pthread_mutex_unlock(&metrics_lock);
+        pthread_join(metrics_thread, NULL);
+        write_file();
+    }
+    metrics_enabled = false;
+
+    double seconds = (now_ns() - metrics_start_ns) / 1e9;
+    unsigned long long instructions = atomic_load(&metrics.instructions);
+    printf("[Info] Metrics: %llu instructions in %.1fs (%.0f/s), %llu frames never presented\n",
+           instructions, seconds, seconds > 0 ? instructions / seconds : 0.0,
+           atomic_load(&metrics.dropped_frames));
+    print_histogram("frame emulate", &metrics.emulate);
+    print_histogram("render/present", &metrics.present);
+    print_histogram("input to frame", &metrics.input);
+    print_histogram("Fx0A", &metrics.fx0a);
+}
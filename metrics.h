@@ -0,0 +1,76 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "utils.h"
+
+/* Runtime metrics. Everything is a relaxed atomic, so any thread can
+ * record and the writer thread can read without locks. Nothing is
+ * recorded per instruction: the instruction counter goes up once per
+ * frame, and the timers only run when metrics_enabled is set.
+ *
+ * Histograms are log-linear like HDR histograms: one group of
+ * 2^METRICS_SUB_BITS buckets per power of two, so any value is within
+ * 1/2^METRICS_SUB_BITS (12.5%) of its bucket, from 1ns to centuries
+*/
+
+#define METRICS_SUB_BITS 3
+#define METRICS_BUCKETS (64 << METRICS_SUB_BITS)
+#define METRICS_INTERVAL_MS 1000
+
+typedef struct MetricsHistogram {
+    const char* name;
+    const char* help;
+    atomic_ullong buckets[METRICS_BUCKETS];
+    atomic_ullong sum_ns;
+} metrics_histogram_t;
+
+typedef struct Metrics {
+    atomic_ullong instructions;     // real frames only, not run-ahead or headless runs
+    atomic_ullong dropped_frames;   // threaded mode, emulated but never shown
+
+    metrics_histogram_t emulate;    // one frame of cpu_emulate_frame
+    metrics_histogram_t present;    // render + present of one frame
+    metrics_histogram_t input;      // key event to the frame using it on screen
+    metrics_histogram_t fx0a;       // each Fx0A instruction
+} metrics_t;
+
+extern metrics_t metrics;
+extern bool metrics_enabled;
+
+static inline void metrics_count(atomic_ullong* counter, unsigned long long n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+// metrics_bucket - values below 2^METRICS_SUB_BITS get a bucket each,
+// above that the top METRICS_SUB_BITS bits after the leading one pick
+// the bucket within its power of two
+static inline int metrics_bucket(unsigned long long v) {
+    if (v < (1 << METRICS_SUB_BITS)) {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    return ((e - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+           + ((v >> (e - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1));
+}
+
+static inline void metrics_record(metrics_histogram_t* hist, unsigned long long ns) {
+    atomic_fetch_add_explicit(&hist->buckets[metrics_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum_ns, ns, memory_order_relaxed);
+}
+
+// metrics_start - turns the timers on. If fname isn't NULL the metrics
+// are written to it every METRICS_INTERVAL_MS in the Prometheus text
+// format, through a temporary file and a rename so readers (e.g. the
+// node exporter textfile collector) never see half a file
+void metrics_start(const char* fname);
+
+// metrics_stop - writes the file one last time and prints a summary
+void metrics_stop();
+
+#endif // METRICS_H
@@ -0,0 +1,187 @@
+#include "pipeline.h"
+#include <math.h>
+#include <time.h>
+
+#define PIPELINE_FRAME_NS 16666667ULL   // 60 fps
+#define PIPELINE_FRESH 0x4              // set in middle when it holds an unread frame
+
+void frame_stats_tick(frame_stats_t* stats) {
+    unsigned long long now = now_ns();
+    if (stats->last_ns != 0) {
+        double ms = (now - stats->last_ns) / 1e6;
+        stats->count++;
+        stats->sum_ms += ms;
+        stats->sum_sq_ms += ms * ms;
+        if (ms > stats->max_ms) {
+            stats->max_ms = ms;
+        }
+        if (ms > PIPELINE_FRAME_NS * 1.5 / 1e6) {
+            stats->late++;
+        }
+    }
+    stats->last_ns = now;
+}
+
+void frame_stats_print(const char* name, frame_stats_t* stats) {
+    if (stats->count == 0) {
+        return;
+    }
+    double mean = stats->sum_ms / stats->count;
+    double var = stats->sum_sq_ms / stats->count - mean * mean;
+    printf("[Info] %s: %llu frames, %.2fms mean, %.2fms jitter, %.2fms max, %llu late\n",
+           name, stats->count, mean, var > 0 ? sqrt(var) : 0.0, stats->max_ms, stats->late);
+}
+
+static void pipeline_drain_input(pipeline_t* pipeline) {
+    unsigned int tail = atomic_load_explicit(&pipeline->input_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&pipeline->input_head, memory_order_acquire);
+    for (; tail != head; tail++) {
+        pipeline_input_t* input = &pipeline->input_queue[tail & (PIPELINE_INPUT_QUEUE_LEN - 1)];
+        cpu_log_io(pipeline->cpu, input->key);
+        if (pipeline->input_ns == 0) {
+            pipeline->input_ns = input->pushed_ns;
+        }
+    }
+    atomic_store_explicit(&pipeline->input_tail, tail, memory_order_release);
+}
+
+static void pipeline_publish(pipeline_t* pipeline, unsigned long long frame) {
+    frame_buffer_t* fb = &pipeline->buffers[pipeline->back];
+    for (int i = 0; i < 32; i++) {
+        fb->rows[i] = cpu_vram_row(pipeline->cpu, i);
+    }
+    fb->frame = frame;
+    fb->input_ns = pipeline->input_ns;
+    pipeline->input_ns = 0;
+    unsigned int old = atomic_exchange_explicit(&pipeline->middle, pipeline->back | PIPELINE_FRESH,
+                                                memory_order_acq_rel);
+    pipeline->back = old & ~PIPELINE_FRESH;
+
+    // the frame we got back was never shown, so its key (if any)
+    // will first be on screen with the next one
+    if (old & PIPELINE_FRESH) {
+        pipeline->input_ns = pipeline->buffers[pipeline->back].input_ns;
+    }
+}
+
+static void* pipeline_thread(void* arg) {
+    pipeline_t* pipeline = (pipeline_t*)arg;
+    cpu_t* cpu = pipeline->cpu;
+    unsigned long long frame = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    while (atomic_load_explicit(&pipeline->running, memory_order_relaxed) == true) {
+        pipeline_drain_input(pipeline);
+        unsigned long long start = metrics_enabled == true ? now_ns() : 0;
+        cpu_emulate_frame(cpu);
+        if (metrics_enabled == true) {
+            metrics_record(&metrics.emulate, now_ns() - start);
+            metrics_count(&metrics.instructions, cycles_per_frame);
+        }
+        if (pipeline->rec != NULL) {
+            recorder_frame(pipeline->rec, cpu);
+        }
+        if (pipeline->shm != NULL) {
+            shm_export_frame(pipeline->shm, cpu);
+        }
+        frame++;
+
+        // Same run-ahead as the single threaded loop, but the
+        // future frame is what gets published
+        if (pipeline->run_ahead > 0) {
+            cpu_save_state(cpu, &pipeline->run_ahead_state);
+            for (int i = 0; i < pipeline->run_ahead; i++) {
+                cpu_emulate_frame(cpu);
+            }
+            pipeline_publish(pipeline, frame);
+            cpu_load_state(cpu, &pipeline->run_ahead_state);
+        } else {
+            pipeline_publish(pipeline, frame);
+        }
+        cpu_flush_io_buffer(cpu);
+        frame_stats_tick(&pipeline->emulate_stats);
+
+        // Sleep until the next frame is due. If we fell more than a
+        // frame behind, start over from now instead of bursting
+        deadline.tv_nsec += PIPELINE_FRAME_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        unsigned long long due = deadline.tv_sec * 1000000000ULL + deadline.tv_nsec;
+        if (now_ns() > due + PIPELINE_FRAME_NS) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+        } else {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        }
+    }
+    return NULL;
+}
+
+pipeline_t* pipeline_start(cpu_t* cpu, recorder_t* rec, shm_export_t* shm, int run_ahead) {
+    pipeline_t* pipeline = (pipeline_t*)malloc(sizeof(pipeline_t));
+    memset(pipeline, 0, sizeof(pipeline_t));
+    pipeline->cpu = cpu;
+    pipeline->rec = rec;
+    pipeline->shm = shm;
+    pipeline->run_ahead = run_ahead;
+    pipeline->back = 0;
+    atomic_init(&pipeline->middle, 1);
+    pipeline->front = 2;
+    atomic_init(&pipeline->input_head, 0);
+    atomic_init(&pipeline->input_tail, 0);
+    atomic_init(&pipeline->running, true);
+
+    // Fx0A must not poll SDL from this thread, keys come in
+    // through the input queue instead
+    cpu->headless = true;
+
+    if (pthread_create(&pipeline->thread, NULL, pipeline_thread, pipeline) != 0) {
+        Log("Unable to start emulation thread!", 2);
+        cpu->headless = false;
+        free(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+void pipeline_push_key(pipeline_t* pipeline, char key) {
+    unsigned int head = atomic_load_explicit(&pipeline->input_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&pipeline->input_tail, memory_order_acquire);
+    if (head - tail == PIPELINE_INPUT_QUEUE_LEN) {
+        Log("Input queue full, dropping key", 1);
+        return;
+    }
+    pipeline_input_t* input = &pipeline->input_queue[head & (PIPELINE_INPUT_QUEUE_LEN - 1)];
+    input->key = key;
+    input->pushed_ns = metrics_enabled == true ? now_ns() : 0;
+    atomic_store_explicit(&pipeline->input_head, head + 1, memory_order_release);
+}
+
+frame_buffer_t* pipeline_latest_frame(pipeline_t* pipeline) {
+    if (atomic_load_explicit(&pipeline->middle, memory_order_relaxed) & PIPELINE_FRESH) {
+        unsigned int old = atomic_exchange_explicit(&pipeline->middle, pipeline->front, memory_order_acq_rel);
+        unsigned long long last_frame = pipeline->buffers[pipeline->front].frame;
+        pipeline->front = old & ~PIPELINE_FRESH;
+
+        frame_buffer_t* fb = &pipeline->buffers[pipeline->front];
+        if (last_frame != 0 && fb->frame > last_frame + 1) {
+            pipeline->dropped += fb->frame - last_frame - 1;
+            metrics_count(&metrics.dropped_frames, fb->frame - last_frame - 1);
+        }
+    }
+    return &pipeline->buffers[pipeline->front];
+}
+
+void pipeline_stop(pipeline_t* pipeline) {
+    atomic_store(&pipeline->running, false);
+    pthread_join(pipeline->thread, NULL);
+
+    frame_stats_print("Pipelined emulation", &pipeline->emulate_stats);
+    frame_stats_print("Pipelined present", &pipeline->present_stats);
+    printf("[Info] Pipelined: %llu emulated frames never presented\n", pipeline->dropped);
+
+    pipeline->cpu->headless = false;
+    free(pipeline);
+}
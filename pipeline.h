@@ -0,0 +1,95 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "utils.h"
+#include "cpu.h"
+#include "record.h"
+#include "shm.h"
+#include "metrics.h"
+
+#define PIPELINE_INPUT_QUEUE_LEN 256    // must be a power of 2
+
+// frame_stats_t - frame interval jitter for one side of the loop
+typedef struct FrameStats {
+    unsigned long long last_ns;
+    unsigned long long count;
+    double sum_ms;
+    double sum_sq_ms;
+    double max_ms;
+    unsigned long long late;        // intervals over 1.5 frames (missed a vsync)
+} frame_stats_t;
+
+// frame_buffer_t - one finished frame, vram packed one row per word
+typedef struct FrameBuffer {
+    unsigned long long rows[32];
+    unsigned long long frame;
+    unsigned long long input_ns;    // oldest key this frame used, 0 = none (metrics)
+} frame_buffer_t;
+
+typedef struct PipelineInput {
+    unsigned long long pushed_ns;   // 0 unless metrics are on
+    char key;
+} pipeline_input_t;
+
+/* The emulation thread renders into its back buffer and then swaps it
+ * with the middle one. The render thread swaps the middle buffer with
+ * its front buffer whenever a newer frame is there. Neither side ever
+ * waits for the other, a frame nobody picked up is simply overwritten
+*/
+typedef struct Pipeline {
+    cpu_t* cpu;
+    recorder_t* rec;
+    shm_export_t* shm;
+    int run_ahead;
+    cpu_state_t run_ahead_state;
+    unsigned long long input_ns;    // oldest key not published yet, emulation thread only
+
+    frame_buffer_t buffers[3];
+    atomic_uint middle;             // buffer index, PIPELINE_FRESH if unread
+    unsigned int back;              // owned by the emulation thread
+    unsigned int front;             // owned by the render thread
+
+    // single producer (render thread), single consumer (emulation thread)
+    pipeline_input_t input_queue[PIPELINE_INPUT_QUEUE_LEN];
+    atomic_uint input_head;
+    atomic_uint input_tail;
+
+    pthread_t thread;
+    atomic_bool running;
+
+    frame_stats_t emulate_stats;    // emulation thread only
+    frame_stats_t present_stats;    // render thread only
+    unsigned long long dropped;     // emulated frames that were never shown
+} pipeline_t;
+
+// frame_stats_tick - call once per frame, records the time since the last call
+void frame_stats_tick(frame_stats_t* stats);
+
+// frame_stats_print - prints mean, jitter (stddev), max and late frames
+void frame_stats_print(const char* name, frame_stats_t* stats);
+
+// pipeline_start - starts emulating the cpu at 60 fps on its own thread.
+// rec and shm may be NULL. The cpu belongs to the pipeline until pipeline_stop.
+// Returns NULL, with the cpu left as it was, if the thread can't be started
+pipeline_t* pipeline_start(cpu_t* cpu, recorder_t* rec, shm_export_t* shm, int run_ahead);
+
+// pipeline_push_key - queues a key press for the next emulated frame.
+// Render thread only
+void pipeline_push_key(pipeline_t* pipeline, char key);
+
+// pipeline_latest_frame - returns the newest finished frame, never blocks.
+// The frame stays valid until the next call. Render thread only
+frame_buffer_t* pipeline_latest_frame(pipeline_t* pipeline);
+
+// pipeline_stop - stops the emulation thread, prints the frame stats
+// and frees the pipeline
+void pipeline_stop(pipeline_t* pipeline);
+
+#endif // PIPELINE_H
@@ -0,0 +1,360 @@
+#include "record.h"
+
+#define RECORD_VERSION 1
+#define RECORD_HEADER_LEN 5
+
+static void write_u32(FILE* fp, unsigned int v) {
+    unsigned char b[4];
+    put_u32(b, v);
+    fwrite(b, 1, 4, fp);
+}
+
+static bool read_u32(FILE* fp, unsigned int* v) {
+    unsigned char b[4];
+    if (fread(b, 1, 4, fp) != 4) {
+        return false;
+    }
+    *v = get_u32(b);
+    return true;
+}
+
+// rle_write - writes len bytes, runs of zero bytes become 0x00 <count>
+static void rle_write(FILE* fp, const unsigned char* data, size_t len) {
+    unsigned char out[32 * 8 * 2];
+    size_t out_len = 0;
+    for (size_t i = 0; i < len;) {
+        if (data[i] != 0) {
+            out[out_len++] = data[i++];
+            continue;
+        }
+        unsigned char run = 0;
+        while (i < len && data[i] == 0 && run < 255) {
+            run++;
+            i++;
+        }
+        out[out_len++] = 0;
+        out[out_len++] = run;
+    }
+    fwrite(out, 1, out_len, fp);
+}
+
+// rle_read - decodes exactly len bytes
+static bool rle_read(FILE* fp, unsigned char* data, size_t len) {
+    for (size_t i = 0; i < len;) {
+        int c = fgetc(fp);
+        if (c == EOF) {
+            return false;
+        }
+        if (c != 0) {
+            data[i++] = c;
+            continue;
+        }
+        int run = fgetc(fp);
+        if (run == EOF || i + run > len) {
+            return false;
+        }
+        memset(data + i, 0, run);
+        i += run;
+    }
+    return true;
+}
+
+static void row_to_bytes(unsigned long long row, unsigned char* out) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = row >> (56 - 8 * i);
+    }
+}
+
+static unsigned long long bytes_to_row(const unsigned char* in) {
+    unsigned long long row = 0;
+    for (int i = 0; i < 8; i++) {
+        row = (row << 8) | in[i];
+    }
+    return row;
+}
+
+recorder_t* recorder_open(const char* fname) {
+    FILE* fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        Log("Unable to open recording file!", 2);
+        return NULL;
+    }
+
+    recorder_t* rec = (recorder_t*)malloc(sizeof(recorder_t));
+    memset(rec, 0, sizeof(recorder_t));
+    rec->fp = fp;
+    rec->index_cap = 64;
+    rec->index = (record_index_t*)malloc(sizeof(record_index_t) * rec->index_cap);
+
+    fwrite("C8RC", 1, 4, fp);
+    fputc(RECORD_VERSION, fp);
+    return rec;
+}
+
+static void recorder_flush_skip(recorder_t* rec) {
+    if (rec->pending_skip > 0) {
+        fputc('S', rec->fp);
+        fputc(rec->pending_skip, rec->fp);
+        rec->pending_skip = 0;
+    }
+}
+
+void recorder_frame(recorder_t* rec, cpu_t* cpu) {
+    unsigned long long start = now_ns();
+    unsigned char buff[32 * 8];
+
+    if (rec->frames % RECORD_KEYFRAME_INTERVAL == 0) {
+        // Keyframe - every row, so playback can start from here
+        recorder_flush_skip(rec);
+        if (rec->index_len == rec->index_cap) {
+            rec->index_cap *= 2;
+            rec->index = (record_index_t*)realloc(rec->index, sizeof(record_index_t) * rec->index_cap);
+        }
+        rec->index[rec->index_len].frame = rec->frames;
+        rec->index[rec->index_len].offset = ftell(rec->fp);
+        rec->index_len++;
+
+        for (int i = 0; i < 32; i++) {
+            rec->rows[i] = cpu_vram_row(cpu, i);
+            row_to_bytes(rec->rows[i], buff + i * 8);
+        }
+        fputc('K', rec->fp);
+        rle_write(rec->fp, buff, sizeof(buff));
+    } else {
+        // Delta - only dirty rows can have changed, and a dirty row
+        // can still end up the same (sprite erased and redrawn)
+        unsigned int dirty = cpu->vram_dirty;
+        unsigned int mask = 0;
+        size_t len = 0;
+        while (dirty != 0) {
+            int i = __builtin_ctz(dirty);
+            dirty &= dirty - 1;
+
+            unsigned long long row = cpu_vram_row(cpu, i);
+            unsigned long long delta = row ^ rec->rows[i];
+            if (delta != 0) {
+                mask |= 1u << i;
+                row_to_bytes(delta, buff + len);
+                len += 8;
+                rec->rows[i] = row;
+            }
+        }
+
+        if (mask == 0) {
+            rec->pending_skip++;
+            if (rec->pending_skip == 255) {
+                recorder_flush_skip(rec);
+            }
+        } else {
+            recorder_flush_skip(rec);
+            fputc('D', rec->fp);
+            write_u32(rec->fp, mask);
+            rle_write(rec->fp, buff, len);
+        }
+    }
+    rec->frames++;
+
+    unsigned long long elapsed = now_ns() - start;
+    rec->total_ns += elapsed;
+    if (elapsed > rec->max_ns) {
+        rec->max_ns = elapsed;
+    }
+}
+
+void recorder_close(recorder_t* rec) {
+    recorder_flush_skip(rec);
+
+    unsigned int index_offset = ftell(rec->fp);
+    fputc('I', rec->fp);
+    write_u32(rec->fp, rec->frames);
+    write_u32(rec->fp, rec->index_len);
+    for (unsigned int i = 0; i < rec->index_len; i++) {
+        write_u32(rec->fp, rec->index[i].frame);
+        write_u32(rec->fp, rec->index[i].offset);
+    }
+    write_u32(rec->fp, index_offset);
+    fwrite("C8IX", 1, 4, rec->fp);
+
+    long size = ftell(rec->fp);
+    fclose(rec->fp);
+
+    // 16.7ms per frame at 60 fps, so 1% is ~167us
+    printf("[Info] Recorded %u frames in %ld bytes (%.1f KB/min), "
+           "recorder took %.2fus/frame avg, %.2fus max\n",
+           rec->frames, size,
+           rec->frames > 0 ? size / 1024.0 / (rec->frames / 3600.0) : 0.0,
+           rec->frames > 0 ? rec->total_ns / 1000.0 / rec->frames : 0.0,
+           rec->max_ns / 1000.0);
+
+    free(rec->index);
+    free(rec);
+}
+
+player_t* player_open(const char* fname) {
+    FILE* fp = fopen(fname, "rb");
+    if (fp == NULL) {
+        Log("Unable to open recording file!", 2);
+        return NULL;
+    }
+    char magic[4];
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "C8RC", 4) != 0 || fgetc(fp) != RECORD_VERSION) {
+        Log("Not a recording file!", 2);
+        fclose(fp);
+        return NULL;
+    }
+
+    player_t* player = (player_t*)malloc(sizeof(player_t));
+    memset(player, 0, sizeof(player_t));
+    player->fp = fp;
+
+    // Load the keyframe index from the end of the file if it's there.
+    // Anything in it that doesn't fit the file means it's damaged, and
+    // the recording is played as if it had none
+    long end = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) - 8 : -1;
+    unsigned int index_offset;
+    unsigned int len = 0;
+    if (end >= RECORD_HEADER_LEN && fseek(fp, end, SEEK_SET) == 0 && read_u32(fp, &index_offset) == true
+        && fread(magic, 1, 4, fp) == 4 && memcmp(magic, "C8IX", 4) == 0
+        && index_offset >= RECORD_HEADER_LEN && index_offset < end
+        && fseek(fp, index_offset, SEEK_SET) == 0 && fgetc(fp) == 'I'
+        && read_u32(fp, &player->total_frames) == true && read_u32(fp, &len) == true
+        && 9 + 8ULL * len == (unsigned long long)(end - index_offset)) {
+        player->index = (record_index_t*)malloc(sizeof(record_index_t) * (len + 1ULL));
+        for (unsigned int i = 0; player->index != NULL && i < len; i++) {
+            record_index_t* entry = &player->index[i];
+            if (read_u32(fp, &entry->frame) == false || read_u32(fp, &entry->offset) == false
+                || entry->offset < RECORD_HEADER_LEN || entry->offset >= index_offset
+                || (i > 0 && entry->frame <= player->index[i-1].frame)) {
+                free(player->index);
+                player->index = NULL;
+            }
+        }
+    }
+    if (player->index != NULL) {
+        player->index_len = len;
+    } else {
+        player->total_frames = 0;
+        Log("Recording has no index, seeking will be slow", 1);
+    }
+
+    fseek(fp, RECORD_HEADER_LEN, SEEK_SET);
+    return player;
+}
+
+bool player_next_frame(player_t* player) {
+    if (player->skip > 0) {
+        player->skip--;
+        player->frame++;
+        return true;
+    }
+
+    unsigned char buff[32 * 8];
+    unsigned int mask;
+    int n;
+    switch (fgetc(player->fp)) {
+        case 'K':
+            if (rle_read(player->fp, buff, sizeof(buff)) == false) {
+                return false;
+            }
+            for (int i = 0; i < 32; i++) {
+                player->rows[i] = bytes_to_row(buff + i * 8);
+            }
+            break;
+        case 'D':
+            if (read_u32(player->fp, &mask) == false
+                || rle_read(player->fp, buff, __builtin_popcount(mask) * 8) == false) {
+                return false;
+            }
+            for (int i = 0, j = 0; i < 32; i++) {
+                if (mask & (1u << i)) {
+                    player->rows[i] ^= bytes_to_row(buff + j * 8);
+                    j++;
+                }
+            }
+            break;
+        case 'S':
+            n = fgetc(player->fp);
+            if (n == EOF || n == 0) {
+                return false;
+            }
+            player->skip = n - 1;
+            break;
+        default:
+            // 'I' or the end of an unfinished recording
+            return false;
+    }
+    player->frame++;
+    return true;
+}
+
+bool player_seek(player_t* player, unsigned int frame) {
+    // last keyframe at or before the frame we want
+    unsigned int offset = RECORD_HEADER_LEN;
+    unsigned int start = 0;
+    int lo = 0, hi = (int)player->index_len - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (player->index[mid].frame <= frame) {
+            offset = player->index[mid].offset;
+            start = player->index[mid].frame;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    fseek(player->fp, offset, SEEK_SET);
+    player->frame = start;
+    player->skip = 0;
+    while (player->frame < frame) {
+        if (player_next_frame(player) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void player_render(SDL_Renderer* renderer, player_t* player) {
+    cpu_render_rows(renderer, player->rows);
+}
+
+void player_close(player_t* player) {
+    fclose(player->fp);
+    free(player->index);
+    free(player);
+}
+
+bool record_export_y4m(const char* rec_fname, const char* y4m_fname) {
+    player_t* player = player_open(rec_fname);
+    if (player == NULL) {
+        return false;
+    }
+    FILE* fp = fopen(y4m_fname, "wb");
+    if (fp == NULL) {
+        Log("Unable to open video file!", 2);
+        player_close(player);
+        return false;
+    }
+
+    int width = 64 * x_window_scale;
+    int height = 32 * y_window_scale;
+    unsigned char* line = (unsigned char*)malloc(width);
+    fprintf(fp, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 Cmono\n", width, height);
+    while (player_next_frame(player) == true) {
+        fprintf(fp, "FRAME\n");
+        for (int i = 0; i < 32; i++) {
+            for (int j = 0; j < width; j++) {
+                line[j] = (player->rows[i] >> (63 - j / x_window_scale)) & 0x1 ? 255 : 0;
+            }
+            for (int k = 0; k < y_window_scale; k++) {
+                fwrite(line, 1, width, fp);
+            }
+        }
+    }
+
+    printf("[Info] Exported %u frames\n", player->frame);
+    free(line);
+    fclose(fp);
+    player_close(player);
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "utils.h"
+#include "cpu.h"
+
+/* Recording file layout (all integers little endian):
+ * - "C8RC" + version byte
+ * - one record per frame:
+ *      'K' RLE(all 32 rows)                keyframe
+ *      'D' u32 row mask RLE(row XOR deltas) only the rows that changed
+ *      'S' u8 n                            n frames with no change
+ * - when the recording is closed cleanly, the keyframe index:
+ *      'I' u32 total frames, u32 n, n * (u32 frame, u32 offset),
+ *      then u32 offset of 'I' and "C8IX" as the last 8 bytes
+ * Rows are 8 bytes each, column 0 in the top bit of the first byte.
+ * RLE only compresses zero bytes: 0x00 is followed by a run length.
+ * A recording without an index (emulator crashed) or with a damaged
+ * one still plays, it just can't seek quickly
+*/
+
+#define RECORD_KEYFRAME_INTERVAL 600    // 10 seconds at 60 fps
+#define RECORD_FRAME_NS 16666667ULL     // playback speed, 60 fps
+
+typedef struct RecordIndexEntry {
+    unsigned int frame;
+    unsigned int offset;
+} record_index_t;
+
+typedef struct Recorder {
+    FILE* fp;
+    unsigned long long rows[32];    // the frame last written
+    unsigned int frames;
+    unsigned int pending_skip;      // unchanged frames not written yet
+
+    record_index_t* index;
+    unsigned int index_len;
+    unsigned int index_cap;
+
+    // recorder cost, so we know it stays well under a frame
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+} recorder_t;
+
+typedef struct Player {
+    FILE* fp;
+    unsigned long long rows[32];    // the frame last decoded
+    unsigned int frame;             // number of frames decoded so far
+    unsigned int skip;              // unchanged frames still to hand out
+    unsigned int total_frames;      // 0 if the recording has no index
+
+    record_index_t* index;
+    unsigned int index_len;
+} player_t;
+
+// recorder_open - starts a new recording. Returns NULL on error
+recorder_t* recorder_open(const char* fname);
+
+// recorder_frame - call once after every cpu_emulate_frame. Only the
+// rows in cpu->vram_dirty are looked at
+void recorder_frame(recorder_t* rec, cpu_t* cpu);
+
+// recorder_close - writes the keyframe index, prints the recorder
+// stats and frees the recorder
+void recorder_close(recorder_t* rec);
+
+// player_open - opens a recording for playback. Returns NULL on error
+player_t* player_open(const char* fname);
+
+// player_next_frame - decodes the next frame into player->rows.
+// Returns false at the end of the recording
+bool player_next_frame(player_t* player);
+
+// player_seek - positions the player so that the next player_next_frame
+// decodes the given (0 based) frame, starting from the closest keyframe
+// before it. Returns false if the recording is shorter than that
+bool player_seek(player_t* player, unsigned int frame);
+
+// player_render - draws player->rows, same as cpu_render_to_screen
+void player_render(SDL_Renderer* renderer, player_t* player);
+
+void player_close(player_t* player);
+
+// record_export_y4m - decodes a whole recording into an uncompressed
+// YUV4MPEG2 (monochrome) video, scaled by the window scale.
+// Returns false on error
+bool record_export_y4m(const char* rec_fname, const char* y4m_fname);
+
+#endif // RECORD_H
@@ -0,0 +1,424 @@
+#include "regress.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REGRESS_MAX_TESTS 256
+#define REGRESS_MAX_LINES 1024
+
+typedef struct RegressInput {
+    int first_frame;
+    int last_frame;
+    char key;
+} regress_input_t;
+
+typedef struct RegressCheckpoint {
+    int frame;
+    unsigned long long hash;
+    bool record;    // hash was "?", just print it
+} regress_checkpoint_t;
+
+typedef struct RegressTest {
+    char rom[256];
+    char inputs[256];
+    char checkpoints[256];
+
+    // filled in by the worker
+    bool passed;
+    char message[512];
+} regress_test_t;
+
+typedef struct RegressSuite {
+    regress_test_t tests[REGRESS_MAX_TESTS];
+    int num_tests;
+    atomic_int next_test;
+} regress_suite_t;
+
+static unsigned long long hash_row(unsigned long long bits, int row) {
+    // splitmix64 finalizer, salted with the row so that
+    // identical rows at different heights don't cancel out
+    unsigned long long h = bits + 0x9e3779b97f4a7c15ULL * (row + 1);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+void fb_hash_init(fb_hash_t* fh, cpu_t* cpu) {
+    fh->hash = 0;
+    for (int i = 0; i < 32; i++) {
+        fh->row_hash[i] = hash_row(cpu_vram_row(cpu, i), i);
+        fh->hash ^= fh->row_hash[i];
+    }
+}
+
+void fb_hash_update(fb_hash_t* fh, cpu_t* cpu) {
+    unsigned int dirty = cpu->vram_dirty;
+    while (dirty != 0) {
+        int i = __builtin_ctz(dirty);
+        dirty &= dirty - 1;
+
+        unsigned long long h = hash_row(cpu_vram_row(cpu, i), i);
+        fh->hash ^= fh->row_hash[i] ^ h;
+        fh->row_hash[i] = h;
+    }
+}
+
+bool write_ppm(const char* fname, cpu_t* cpu) {
+    FILE* fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        Log("Unable to write PPM file!", 2);
+        return false;
+    }
+    fprintf(fp, "P6\n64 32\n255\n");
+    for (size_t i = 0; i < 32; i++) {
+        for (size_t j = 0; j < 64; j++) {
+            unsigned char c = cpu->vram[i][j] == true ? 255 : 0;
+            unsigned char pixel[3] = {c, c, c};
+            fwrite(pixel, 1, 3, fp);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// read_ppm_pixels - reads a 64x32 PPM written by write_ppm
+static bool read_ppm_pixels(const char* fname, bool pixels[32][64]) {
+    FILE* fp = fopen(fname, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    int w = 0, h = 0, maxval = 0;
+    if (fscanf(fp, "P6 %d %d %d", &w, &h, &maxval) != 3 || w != 64 || h != 32) {
+        fclose(fp);
+        return false;
+    }
+    fgetc(fp);  // single whitespace after the header
+    for (size_t i = 0; i < 32; i++) {
+        for (size_t j = 0; j < 64; j++) {
+            unsigned char pixel[3];
+            if (fread(pixel, 1, 3, fp) != 3) {
+                fclose(fp);
+                return false;
+            }
+            pixels[i][j] = pixel[0] > 127;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// write_ppm_diff - white = on in both, red = only on now,
+// green = only on in the golden image
+static void write_ppm_diff(const char* fname, cpu_t* cpu, bool golden[32][64]) {
+    FILE* fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        Log("Unable to write PPM diff!", 2);
+        return;
+    }
+    fprintf(fp, "P6\n64 32\n255\n");
+    for (size_t i = 0; i < 32; i++) {
+        for (size_t j = 0; j < 64; j++) {
+            bool now = cpu->vram[i][j];
+            bool was = golden[i][j];
+            unsigned char pixel[3] = {0, 0, 0};
+            if (now && was) {
+                pixel[0] = pixel[1] = pixel[2] = 255;
+            } else if (now) {
+                pixel[0] = 255;
+            } else if (was) {
+                pixel[1] = 255;
+            }
+            fwrite(pixel, 1, 3, fp);
+        }
+    }
+    fclose(fp);
+}
+
+static int load_inputs(const char* fname, regress_input_t* inputs) {
+    if (strcmp(fname, "-") == 0) {
+        return 0;
+    }
+    FILE* fp = fopen(fname, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    int n = 0;
+    char line[256];
+    while (n < REGRESS_MAX_LINES && fgets(line, sizeof(line), fp) != NULL) {
+        unsigned int key;
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%d %d %x", &inputs[n].first_frame, &inputs[n].last_frame, &key) == 3) {
+            inputs[n].key = key & 0xf;
+            n++;
+        }
+    }
+    fclose(fp);
+    return n;
+}
+
+static int compare_checkpoints(const void* a, const void* b) {
+    return ((const regress_checkpoint_t*)a)->frame - ((const regress_checkpoint_t*)b)->frame;
+}
+
+static int load_checkpoints(const char* fname, regress_checkpoint_t* checkpoints) {
+    FILE* fp = fopen(fname, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    int n = 0;
+    char line[256];
+    while (n < REGRESS_MAX_LINES && fgets(line, sizeof(line), fp) != NULL) {
+        char hash[64];
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%d %63s", &checkpoints[n].frame, hash) == 2) {
+            checkpoints[n].record = strcmp(hash, "?") == 0;
+            checkpoints[n].hash = strtoull(hash, NULL, 16);
+            n++;
+        }
+    }
+    fclose(fp);
+    qsort(checkpoints, n, sizeof(regress_checkpoint_t), compare_checkpoints);
+    return n;
+}
+
+static void run_test(regress_test_t* test) {
+    regress_input_t* inputs = (regress_input_t*)malloc(sizeof(regress_input_t) * REGRESS_MAX_LINES);
+    regress_checkpoint_t* checkpoints = (regress_checkpoint_t*)malloc(sizeof(regress_checkpoint_t) * REGRESS_MAX_LINES);
+    int num_inputs = load_inputs(test->inputs, inputs);
+    int num_checkpoints = load_checkpoints(test->checkpoints, checkpoints);
+    test->passed = false;
+    if (num_inputs < 0 || num_checkpoints < 0) {
+        snprintf(test->message, sizeof(test->message), "unable to read %s",
+                 num_inputs < 0 ? test->inputs : test->checkpoints);
+        free(inputs);
+        free(checkpoints);
+        return;
+    }
+
+    cpu_t* cpu = init_cpu();
+    cpu->headless = true;
+    if (cpu_try_load_program(cpu, test->rom) == false) {
+        snprintf(test->message, sizeof(test->message), "unable to load %s", test->rom);
+        free_cpu(cpu);
+        free(inputs);
+        free(checkpoints);
+        return;
+    }
+
+    fb_hash_t fh;
+    fb_hash_init(&fh, cpu);
+
+    test->passed = true;
+    test->message[0] = '\0';
+    int next = 0;
+    if (num_checkpoints > 0 && checkpoints[0].frame < 0) {
+        snprintf(test->message, sizeof(test->message), "checkpoint frame must be >= 0");
+        test->passed = false;
+    }
+    // frame 0 is the screen before anything ran
+    int last_frame = num_checkpoints > 0 ? checkpoints[num_checkpoints-1].frame : 0;
+    for (int frame = 0; frame <= last_frame && test->passed == true; frame++) {
+        if (frame > 0) {
+            for (int i = 0; i < num_inputs; i++) {
+                if (inputs[i].first_frame <= frame && frame <= inputs[i].last_frame) {
+                    cpu_log_io(cpu, inputs[i].key);
+                }
+            }
+            cpu_emulate_frame(cpu);
+            cpu_flush_io_buffer(cpu);
+            fb_hash_update(&fh, cpu);
+        }
+
+        for (; next < num_checkpoints && checkpoints[next].frame == frame; next++) {
+            // "<checkpoint file>.<frame>.diff.ppm", small enough to fit in message
+            char fname[sizeof(test->checkpoints) + 32];
+            if (checkpoints[next].record == true) {
+                snprintf(fname, sizeof(fname), "%s.%d.ppm", test->checkpoints, frame);
+                write_ppm(fname, cpu);
+                size_t len = strlen(test->message);
+                snprintf(test->message + len, sizeof(test->message) - len,
+                         "\n\t%d %016llx", frame, fh.hash);
+            } else if (checkpoints[next].hash != fh.hash) {
+                // diff against the golden image if there is one,
+                // otherwise all we can show is the current frame
+                bool golden[32][64];
+                snprintf(fname, sizeof(fname), "%s.%d.ppm", test->checkpoints, frame);
+                bool have_golden = read_ppm_pixels(fname, golden);
+                snprintf(fname, sizeof(fname), "%s.%d.diff.ppm", test->checkpoints, frame);
+                if (have_golden == true) {
+                    write_ppm_diff(fname, cpu, golden);
+                } else {
+                    write_ppm(fname, cpu);
+                }
+                snprintf(test->message, sizeof(test->message),
+                         "frame %d: expected %016llx, got %016llx (see %s)",
+                         frame, checkpoints[next].hash, fh.hash, fname);
+                test->passed = false;
+                break;
+            }
+        }
+    }
+
+    free_cpu(cpu);
+    free(inputs);
+    free(checkpoints);
+}
+
+static void* regress_worker(void* arg) {
+    regress_suite_t* suite = (regress_suite_t*)arg;
+    for (;;) {
+        int i = atomic_fetch_add(&suite->next_test, 1);
+        if (i >= suite->num_tests) {
+            return NULL;
+        }
+        run_test(&suite->tests[i]);
+    }
+}
+
+int regress_run_suite(const char* suite_fname) {
+    FILE* fp = fopen(suite_fname, "r");
+    if (fp == NULL) {
+        Log("Unable to open regression suite!", 3);
+        return -1;
+    }
+
+    regress_suite_t* suite = (regress_suite_t*)malloc(sizeof(regress_suite_t));
+    suite->num_tests = 0;
+    atomic_init(&suite->next_test, 0);
+    char line[1024];
+    while (suite->num_tests < REGRESS_MAX_TESTS && fgets(line, sizeof(line), fp) != NULL) {
+        regress_test_t* test = &suite->tests[suite->num_tests];
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%255s %255s %255s", test->rom, test->inputs, test->checkpoints) == 3) {
+            suite->num_tests++;
+        }
+    }
+    fclose(fp);
+
+    // The emulator is silent in here, otherwise the
+    // trace output costs more than the emulation
+    cpu_trace = false;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > suite->num_tests) {
+        num_threads = suite->num_tests;
+    }
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * (num_threads + 1));
+    for (long i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, regress_worker, suite);
+    }
+    for (long i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int failed = 0;
+    for (int i = 0; i < suite->num_tests; i++) {
+        regress_test_t* test = &suite->tests[i];
+        printf("%s %s %s\n", test->passed ? "PASS" : "FAIL", test->rom, test->message);
+        if (test->passed == false) {
+            failed++;
+        }
+    }
+    printf("%d/%d passed in %.3fs on %ld threads\n",
+           suite->num_tests - failed, suite->num_tests,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+           num_threads);
+
+    free(suite);
+    return failed;
+}
+
+// presented_hash - hash of the frame that would be shown with run-ahead,
+// with whatever keys are in the io buffer held down the whole time
+static unsigned long long presented_hash(cpu_t* cpu, cpu_state_t* scratch, int run_ahead) {
+    fb_hash_t fh;
+    cpu_save_state(cpu, scratch);
+    for (int i = 0; i < run_ahead; i++) {
+        cpu_emulate_frame(cpu);
+    }
+    fb_hash_init(&fh, cpu);
+    cpu_load_state(cpu, scratch);
+    return fh.hash;
+}
+
+int regress_measure_latency(const char* program_fname, char key, int press_frame, int max_run_ahead, int expected) {
+    const int max_frames = 600;
+    cpu_trace = false;
+
+    cpu_t* pressed = init_cpu();
+    pressed->headless = true;
+    cpu_load_program(pressed, program_fname);
+    cpu_t* idle = init_cpu();
+    idle->headless = true;
+
+    cpu_state_t* start = (cpu_state_t*)malloc(sizeof(cpu_state_t));
+    cpu_state_t* scratch = (cpu_state_t*)malloc(sizeof(cpu_state_t));
+    for (int frame = 1; frame < press_frame; frame++) {
+        cpu_emulate_frame(pressed);
+    }
+    cpu_save_state(pressed, start);
+
+    int failed = 0;
+    for (int run_ahead = 0; run_ahead <= max_run_ahead; run_ahead++) {
+        // both runs start from the frame before the key edge
+        cpu_load_state(pressed, start);
+        cpu_load_state(idle, start);
+
+        int latency = -1;
+        int frames = 0;
+        struct timespec t0, t1;
+        double run_ahead_us = 0;
+        for (; frames < max_frames && latency < 0; frames++) {
+            cpu_log_io(pressed, key);
+            cpu_emulate_frame(pressed);
+            cpu_emulate_frame(idle);
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            unsigned long long hash = presented_hash(pressed, scratch, run_ahead);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            run_ahead_us += (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+
+            if (hash != presented_hash(idle, scratch, run_ahead)) {
+                latency = frames;
+            }
+            cpu_flush_io_buffer(pressed);
+        }
+
+        int want = expected - run_ahead > 0 ? expected - run_ahead : 0;
+        if (latency < 0) {
+            printf("FAIL run-ahead %d: key %x at frame %d made no difference within %d frames\n",
+                   run_ahead, key, press_frame, max_frames);
+            failed++;
+        } else if (expected >= 0 && latency != want) {
+            printf("FAIL run-ahead %d: key %x at frame %d shows up %d frame(s) later, expected %d\n",
+                   run_ahead, key, press_frame, latency, want);
+            failed++;
+        } else {
+            printf("%srun-ahead %d: key %x at frame %d shows up %d frame(s) later\n",
+                   expected >= 0 ? "PASS " : "", run_ahead, key, press_frame, latency);
+        }
+        printf("\trun-ahead costs %.2fus per frame\n", run_ahead_us / frames);
+    }
+
+    free(start);
+    free(scratch);
+    free_cpu(pressed);
+    free_cpu(idle);
+    return failed;
+}
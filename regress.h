@@ -0,0 +1,53 @@
+#ifndef REGRESS_H
+#define REGRESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "utils.h"
+#include "cpu.h"
+
+// fb_hash_t - a hash of vram that is kept up to date from the dirty
+// rows of each frame, so nothing is rehashed when a row didn't change.
+// The frame hash is the XOR of all row hashes, so a changed row is
+// swapped out with two XORs
+typedef struct FBHash {
+    unsigned long long row_hash[32];
+    unsigned long long hash;
+} fb_hash_t;
+
+// fb_hash_init - hashes every row of vram from scratch
+void fb_hash_init(fb_hash_t* fh, cpu_t* cpu);
+
+// fb_hash_update - rehashes only the rows in cpu->vram_dirty.
+// Call it once after every cpu_emulate_frame
+void fb_hash_update(fb_hash_t* fh, cpu_t* cpu);
+
+// write_ppm - writes vram as a 64x32 binary PPM. Returns false on error
+bool write_ppm(const char* fname, cpu_t* cpu);
+
+// regress_run_suite - runs every test listed in a suite file and prints
+// PASS/FAIL per test. Each line of the suite file is
+//      <rom> <input script or -> <checkpoint file>
+// An input script has lines "<first frame> <last frame> <key>" (key in hex)
+// and holds the key down for those frames. A checkpoint file has lines
+// "<frame> <hash>", where hash is the 16 digit hex framebuffer hash after
+// that many frames (0 = before the first one), or "?" to print the hash
+// and save a golden image.
+// On a mismatch a diff image is written next to the checkpoint file.
+// Tests are spread across all cores. Returns the number of failed tests
+int regress_run_suite(const char* suite_fname);
+
+// regress_measure_latency - presses key from press_frame on and prints how
+// many frames it takes until the presented frame differs from a run where
+// the key is never pressed, for every run-ahead setting from 0 to
+// max_run_ahead. 0 frames means the press shows up in the frame that is
+// presented right after the key went down.
+// If expected isn't negative it is the latency without run-ahead, and
+// every run-ahead of N frames must show it N frames sooner (never below 0).
+// Returns the number of settings where the key made no difference or the
+// latency wasn't the expected one
+int regress_measure_latency(const char* program_fname, char key, int press_frame, int max_run_ahead, int expected);
+
+#endif // REGRESS_H
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE    // accept4
+#include "server.h"
+#include "cpu.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_FRAME_NS 16666667ULL     // 60 fps
+#define SERVER_CHUNK 16                 // sessions a worker claims at a time
+#define SERVER_STATS_TICKS 300          // print stats every 5 seconds
+
+typedef struct ServerSession {
+    int fd;
+    int slot;                       // index in server->sessions
+    cpu_t* cpu;
+
+    unsigned short keys;            // keys currently held down
+    unsigned short pressed;         // keys pressed since the last step
+    unsigned int frame;
+    unsigned int input_seq;         // last input applied
+    unsigned int sent_seq;          // last input seq sent to the client
+
+    unsigned long long sent_rows[32];   // what the client has
+    unsigned int pending_rows;      // rows that might differ from sent_rows
+
+    unsigned char in[SERVER_INPUT_LEN * 16];
+    size_t in_len;
+    unsigned char out[8192];
+    size_t out_len;
+} server_session_t;
+
+typedef struct Server {
+    server_session_t* sessions[SERVER_MAX_SESSIONS];
+    int num_sessions;
+    cpu_t* program;                 // loaded once, copied into new sessions
+
+    // worker threads step sessions between the two barriers
+    pthread_t* workers;
+    int num_workers;
+    pthread_barrier_t tick_start;
+    pthread_barrier_t tick_done;
+    atomic_int next_session;
+    atomic_bool running;
+
+    // stats
+    unsigned long long ticks;
+    unsigned long long step_ns;
+    unsigned long long overruns;
+} server_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// session_step - emulates one frame and queues the rows that changed
+static void session_step(server_session_t* s) {
+    cpu_t* cpu = s->cpu;
+    // a tap that was released before this tick still counts for one frame
+    unsigned short keys = s->keys | s->pressed;
+    s->pressed = 0;
+    for (int k = 0; k < 16; k++) {
+        if (keys & (1 << k)) {
+            cpu_log_io(cpu, k);
+        }
+    }
+    cpu_emulate_frame(cpu);
+    cpu_flush_io_buffer(cpu);
+    s->frame++;
+
+    // Rows that couldn't be sent last time (full buffer) stay
+    // pending, so the next update brings the client up to date
+    s->pending_rows |= cpu->vram_dirty;
+    unsigned long long rows[32];
+    unsigned int mask = 0;
+    unsigned int pending = s->pending_rows;
+    while (pending != 0) {
+        int i = __builtin_ctz(pending);
+        pending &= pending - 1;
+        rows[i] = cpu_vram_row(cpu, i);
+        if (rows[i] != s->sent_rows[i]) {
+            mask |= 1u << i;
+        }
+    }
+    if (mask == 0 && s->input_seq == s->sent_seq) {
+        s->pending_rows = 0;
+        return;
+    }
+
+    size_t len = SERVER_FRAME_HEADER_LEN + __builtin_popcount(mask) * 8;
+    if (s->out_len + len > sizeof(s->out)) {
+        return;
+    }
+    unsigned char* b = s->out + s->out_len;
+    b[0] = 'F';
+    put_u32(b + 1, s->frame);
+    put_u32(b + 5, s->input_seq);
+    put_u32(b + 9, mask);
+    b += SERVER_FRAME_HEADER_LEN;
+    while (mask != 0) {
+        int i = __builtin_ctz(mask);
+        mask &= mask - 1;
+        for (int j = 0; j < 8; j++) {
+            *b++ = rows[i] >> (56 - 8 * j);
+        }
+        s->sent_rows[i] = rows[i];
+    }
+    s->out_len += len;
+    s->sent_seq = s->input_seq;
+    s->pending_rows = 0;
+}
+
+static void* server_worker(void* arg) {
+    server_t* server = (server_t*)arg;
+    for (;;) {
+        pthread_barrier_wait(&server->tick_start);
+        if (atomic_load(&server->running) == false) {
+            return NULL;
+        }
+        for (;;) {
+            int first = atomic_fetch_add(&server->next_session, SERVER_CHUNK);
+            if (first >= server->num_sessions) {
+                break;
+            }
+            int last = first + SERVER_CHUNK;
+            if (last > server->num_sessions) {
+                last = server->num_sessions;
+            }
+            for (int i = first; i < last; i++) {
+                session_step(server->sessions[i]);
+            }
+        }
+        pthread_barrier_wait(&server->tick_done);
+    }
+}
+
+static void server_tick(server_t* server) {
+    unsigned long long start = now_ns();
+
+    // Step every session on the workers. Sessions are only touched
+    // by the I/O thread outside of these two barriers
+    atomic_store(&server->next_session, 0);
+    pthread_barrier_wait(&server->tick_start);
+    pthread_barrier_wait(&server->tick_done);
+
+    server->step_ns += now_ns() - start;
+    server->ticks++;
+
+    // Flush everything the workers queued, one write per session.
+    // Whatever doesn't fit in the socket is retried next tick
+    for (int i = 0; i < server->num_sessions; i++) {
+        server_session_t* s = server->sessions[i];
+        if (s->out_len == 0) {
+            continue;
+        }
+        ssize_t n = send(s->fd, s->out, s->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            memmove(s->out, s->out + n, s->out_len - n);
+            s->out_len -= n;
+        }
+    }
+
+    if (server->ticks % SERVER_STATS_TICKS == 0) {
+        double step_us = server->step_ns / 1000.0 / server->ticks;
+        double per_core = server->num_sessions / (double)server->num_workers;
+        printf("[Info] %d sessions, %.1fus per tick on %d workers, "
+               "~%.0f sessions/core at 60fps, %llu overruns\n",
+               server->num_sessions, step_us, server->num_workers,
+               step_us > 0 ? per_core * (SERVER_FRAME_NS / 1000.0) / step_us : 0.0,
+               server->overruns);
+        server->ticks = 0;
+        server->step_ns = 0;
+    }
+}
+
+// session_open - returns NULL if the server is full
+static server_session_t* session_open(server_t* server, int fd) {
+    if (server->num_sessions == SERVER_MAX_SESSIONS) {
+        Log("Too many sessions, dropping connection", 1);
+        close(fd);
+        return NULL;
+    }
+
+    server_session_t* s = (server_session_t*)malloc(sizeof(server_session_t));
+    memset(s, 0, sizeof(server_session_t));
+    s->fd = fd;
+    s->cpu = init_cpu();
+    s->cpu->headless = true;
+    memcpy(s->cpu->memory, server->program->memory, server->program->memory_len);
+    s->cpu->program_len = server->program->program_len;
+    s->cpu->pc = server->program->pc;
+
+    s->slot = server->num_sessions;
+    server->sessions[server->num_sessions++] = s;
+    return s;
+}
+
+static void session_close(server_t* server, server_session_t* s) {
+    // swap the last session into this slot
+    server_session_t* last = server->sessions[--server->num_sessions];
+    server->sessions[s->slot] = last;
+    last->slot = s->slot;
+
+    close(s->fd);
+    free_cpu(s->cpu);
+    free(s);
+}
+
+// session_read - reads and applies input events. Returns false
+// when the client is gone
+static bool session_read(server_session_t* s) {
+    for (;;) {
+        ssize_t n = read(s->fd, s->in + s->in_len, sizeof(s->in) - s->in_len);
+        if (n == 0) {
+            return false;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        s->in_len += n;
+
+        size_t i = 0;
+        for (; i + SERVER_INPUT_LEN <= s->in_len; i += SERVER_INPUT_LEN) {
+            unsigned char* msg = s->in + i;
+            unsigned short bit = 1 << (msg[1] & 0xf);
+            if (msg[0] == 'P') {
+                s->keys |= bit;
+                s->pressed |= bit;
+            } else if (msg[0] == 'R') {
+                s->keys &= ~bit;
+            }
+            s->input_seq = get_u32(msg + 2);
+        }
+        memmove(s->in, s->in + i, s->in_len - i);
+        s->in_len -= i;
+    }
+}
+
+int server_run(const char* socket_path, const char* program_fname) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        Log("Unable to create server socket!", 3);
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0) {
+        Log("Unable to bind server socket!", 3);
+        close(listen_fd);
+        return -1;
+    }
+
+    int epoll_fd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_fd;   // everything else is a session
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    server_t* server = (server_t*)malloc(sizeof(server_t));
+    memset(server, 0, sizeof(server_t));
+    cpu_trace = false;
+    server->program = init_cpu();
+    cpu_load_program(server->program, program_fname);
+
+    server->num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (server->num_workers < 1) {
+        server->num_workers = 1;
+    }
+    atomic_init(&server->running, true);
+    atomic_init(&server->next_session, 0);
+    pthread_barrier_init(&server->tick_start, NULL, server->num_workers + 1);
+    pthread_barrier_init(&server->tick_done, NULL, server->num_workers + 1);
+    server->workers = (pthread_t*)malloc(sizeof(pthread_t) * server->num_workers);
+    for (int i = 0; i < server->num_workers; i++) {
+        pthread_create(&server->workers[i], NULL, server_worker, server);
+    }
+
+    printf("[Info] Serving %s on %s with %d workers\n", program_fname, socket_path, server->num_workers);
+
+    struct epoll_event events[256];
+    unsigned long long next_tick = now_ns() + SERVER_FRAME_NS;
+    while (stop_requested == 0) {
+        // Handle all I/O that's ready until the next frame is due
+        unsigned long long now = now_ns();
+        // rounded up, rounding down spins on epoll_wait for the last ms
+        int timeout_ms = now < next_tick ? (next_tick - now + 999999) / 1000000 : 0;
+        int n = epoll_wait(epoll_fd, events, 256, timeout_ms);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listen_fd) {
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    server_session_t* s = session_open(server, fd);
+                    if (s != NULL) {
+                        ev.events = EPOLLIN;
+                        ev.data.ptr = s;
+                        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+                    }
+                }
+                continue;
+            }
+
+            server_session_t* s = (server_session_t*)events[i].data.ptr;
+            if (s == NULL) {
+                continue;
+            }
+            if (session_read(s) == false || (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                // drop any later events in this batch for the freed session
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+                for (int j = i + 1; j < n; j++) {
+                    if (events[j].data.ptr == s) {
+                        events[j].data.ptr = NULL;
+                    }
+                }
+                session_close(server, s);
+            }
+        }
+
+        now = now_ns();
+        if (now >= next_tick) {
+            server_tick(server);
+            next_tick += SERVER_FRAME_NS;
+            if (now > next_tick) {
+                // fell a whole frame behind, don't try to catch up
+                server->overruns++;
+                next_tick = now + SERVER_FRAME_NS;
+            }
+        }
+    }
+
+    Log("Shutting down server...", 0);
+    atomic_store(&server->running, false);
+    pthread_barrier_wait(&server->tick_start);
+    for (int i = 0; i < server->num_workers; i++) {
+        pthread_join(server->workers[i], NULL);
+    }
+    while (server->num_sessions > 0) {
+        session_close(server, server->sessions[0]);
+    }
+    pthread_barrier_destroy(&server->tick_start);
+    pthread_barrier_destroy(&server->tick_done);
+    free(server->workers);
+    free_cpu(server->program);
+    free(server);
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "utils.h"
+
+/* Server protocol over a Unix domain stream socket. Every connection
+ * gets its own cpu running the server's program. All integers are
+ * little endian.
+ *
+ * Client -> server, 6 bytes:
+ *      'P' or 'R', key (0x0-0xf), u32 seq     key pressed / released
+ * Server -> client, sent after a frame if any row changed or an input
+ * was applied since the last update:
+ *      'F', u32 frame, u32 seq, u32 row mask, 8 bytes per row in mask
+ * seq is the last input applied before the frame was emulated, so a
+ * client can time input-to-frame latency. Rows are the full new row
+ * (column 0 in the top bit of the first byte), only for rows that
+ * differ from what this client was last sent
+*/
+
+#define SERVER_INPUT_LEN 6
+#define SERVER_FRAME_HEADER_LEN 13
+#define SERVER_MAX_SESSIONS 4096
+
+// server_run - hosts sessions of the given program on a socket until
+// SIGINT/SIGTERM. Frames are stepped at 60 fps across one worker thread
+// per core. Returns non-zero on error
+int server_run(const char* socket_path, const char* program_fname);
+
+#endif // SERVER_H
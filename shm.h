@@ -0,0 +1,34 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "utils.h"
+#include "cpu.h"
+#include "shm_layout.h"
+
+typedef struct ShmExport {
+    char name[256];
+    shm_layout_t* layout;
+    bool all_rows;                      // no frame written yet, dirty rows aren't enough
+} shm_export_t;
+
+// shm_export_open - creates (or takes over) the segment called name,
+// a leading '/' is added if it's missing. Returns NULL on error
+shm_export_t* shm_export_open(const char* name);
+
+// shm_export_frame - publishes the cpu, call once per emulated frame.
+// Only rows marked in vram_dirty are repacked
+void shm_export_frame(shm_export_t* shm, cpu_t* cpu);
+
+// shm_export_close - unmaps and removes the segment
+void shm_export_close(shm_export_t* shm);
+
+// shm_benchmark - runs a program headless as fast as possible with the
+// export on, first alone and then with a separate reader process polling
+// at 1 kHz, and prints both frame rates. Returns non-zero on error
+int shm_benchmark(const char* program_fname, int seconds);
+
+#endif // SHM_H
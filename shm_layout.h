@@ -0,0 +1,96 @@
+#ifndef SHM_LAYOUT_H
+#define SHM_LAYOUT_H
+
+// Everything a reader of the shared memory export needs, with nothing
+// beyond libc and POSIX so outside tools can include it on its own
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Shared memory layout, native endianness. The emulator is the only
+ * writer and never makes a syscall to update it, readers never write.
+ * Consistency is a seqlock: the writer makes seq odd, updates the
+ * snapshot, then makes seq even again. A reader copies the snapshot out
+ * and keeps it only if seq was the same even number before and after
+ * (see shm_read below)
+*/
+
+#define SHM_MAGIC "C8SH"
+#define SHM_VERSION 1
+#define SHM_READ_TRIES 1000             // give up if the writer died mid-update
+
+typedef struct ShmSnapshot {
+    unsigned long long frame;
+    unsigned long long rows[32];        // vram, packed like cpu_vram_row
+    unsigned short pc;
+    unsigned short I;
+    unsigned short sp;
+    unsigned short stack[16];
+    unsigned char reg[16];
+    unsigned char time_delay;
+    unsigned char sound_delay;
+} shm_snapshot_t;
+
+typedef struct ShmLayout {
+    char magic[4];
+    unsigned int version;
+    atomic_uint seq;
+    unsigned int pad;
+    shm_snapshot_t snap;
+} shm_layout_t;
+
+// shm_reader_open - maps an existing segment read only. Returns NULL if
+// it doesn't exist or isn't ours. Undo with munmap
+static inline const shm_layout_t* shm_reader_open(const char* name) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    void* p = mmap(NULL, sizeof(shm_layout_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    const shm_layout_t* layout = (const shm_layout_t*)p;
+    if (memcmp(layout->magic, SHM_MAGIC, 4) != 0 || layout->version != SHM_VERSION) {
+        munmap(p, sizeof(shm_layout_t));
+        return NULL;
+    }
+    return layout;
+}
+
+// shm_read - copies out a consistent snapshot. retries (may be NULL)
+// counts the copies thrown away because the writer got in the way.
+// Returns false if the writer never finished an update
+static inline bool shm_read(const shm_layout_t* layout, shm_snapshot_t* out, unsigned int* retries) {
+    shm_layout_t* l = (shm_layout_t*)layout;
+    for (int i = 0; i < SHM_READ_TRIES; i++) {
+        unsigned int before = atomic_load_explicit(&l->seq, memory_order_acquire);
+        if ((before & 1) == 0) {
+            memcpy(out, &layout->snap, sizeof(shm_snapshot_t));
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&l->seq, memory_order_relaxed) == before) {
+                return true;
+            }
+        }
+        if (retries != NULL) {
+            (*retries)++;
+        }
+        // the writer may be preempted mid-update, let it finish
+        if (i >= 16) {
+            sched_yield();
+        }
+    }
+    return false;
+}
+
+#endif // SHM_LAYOUT_H
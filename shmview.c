@@ -0,0 +1,60 @@
+// shmview - reference reader for the shared memory export (see shm_layout.h).
+// Prints the registers and the screen of a running emulator, either
+// once or continuously at the given rate.
+//
+//      cc -O2 -o shmview shmview.c
+//      ./shmview <name> [hz]
+
+#include "shm_layout.h"
+#include <time.h>
+
+static void print_snapshot(shm_snapshot_t* snap, unsigned int retries) {
+    printf("frame %llu  pc=0x%03x I=0x%03x sp=%u dt=%u st=%u retries=%u\n",
+           snap->frame, snap->pc, snap->I, snap->sp, snap->time_delay, snap->sound_delay, retries);
+    for (int i = 0; i < 16; i++) {
+        printf("v%x=%02x%s", i, snap->reg[i], i == 7 || i == 15 ? "\n" : " ");
+    }
+    for (int i = 0; i < 32; i++) {
+        char line[65];
+        for (int j = 0; j < 64; j++) {
+            line[j] = (snap->rows[i] >> (63 - j)) & 0x1 ? '#' : '.';
+        }
+        line[64] = '\0';
+        printf("%s\n", line);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("usage: %s <name> [hz]\n", argv[0]);
+        return 1;
+    }
+    const shm_layout_t* layout = shm_reader_open(argv[1]);
+    if (layout == NULL) {
+        printf("no emulator is exporting %s\n", argv[1]);
+        return 1;
+    }
+
+    double hz = argc > 2 ? atof(argv[2]) : 0;
+    shm_snapshot_t snap;
+    unsigned int retries = 0;
+    do {
+        if (shm_read(layout, &snap, &retries) == false) {
+            printf("writer stopped in the middle of an update\n");
+            return 1;
+        }
+        if (hz > 0) {
+            // home the cursor so the screen redraws in place
+            printf("\033[H\033[2J");
+        }
+        print_snapshot(&snap, retries);
+        fflush(stdout);
+        if (hz > 0) {
+            struct timespec ts = {0, (long)(1e9 / hz)};
+            nanosleep(&ts, NULL);
+        }
+    } while (hz > 0);
+
+    munmap((void*)layout, sizeof(shm_layout_t));
+    return 0;
+}
@@ -1,18 +1,21 @@
 #include "utils.h"
+#include <time.h>
 
 int memory_size = 4096;
 int max_file_size = 65536;
 int max_program_size = 1024;
 int x_window_scale = 10;
 int y_window_scale = 10;
+int cycles_per_frame = 10;
+bool cpu_trace = true;
 
-unsigned char* read_file_binary(const char* fname) {
+unsigned char* read_file_binary(const char* fname, size_t* len) {
     // Open the file. If an error occurs,
     // just log it and return NULL.
     Log("Opening and reading binary file...", 0);
     FILE* fp = fopen(fname, "r");
     if (fp == NULL) {
-        Log("Unable to open file!", 3);
+        Log("Unable to open file!", 2);
         return NULL;
     }
 
@@ -25,6 +28,12 @@ unsigned char* read_file_binary(const char* fname) {
     }
     fclose(fp);
 
+    // Binary files can contain zero bytes, so hand the
+    // real size back instead of relying on strnlen
+    if (len != NULL) {
+        *len = buff_size;
+    }
+
     Log("Successfully opened and read binary file", 0);
 
     // Now return the buffer
@@ -54,4 +63,21 @@ char* read_file(const char* fname) {
 
     // Now return the buffer
     return buff;
-}
\ No newline at end of file
+}
+
+unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void put_u32(unsigned char* b, unsigned int v) {
+    b[0] = v & 0xff;
+    b[1] = (v >> 8) & 0xff;
+    b[2] = (v >> 16) & 0xff;
+    b[3] = v >> 24;
+}
+
+unsigned int get_u32(const unsigned char* b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+}
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include "logger.h"
 
 // global variable declaration
@@ -11,9 +12,20 @@ extern int max_file_size;
 extern int max_program_size;
 extern int x_window_scale;
 extern int y_window_scale;
+extern int cycles_per_frame;    // instructions executed per 60Hz frame
+extern bool cpu_trace;          // print every emulated instruction
 
 // utility functions (should be accessible to everything)
-unsigned char* read_file_binary(const char* fname);
+// read_file_binary - len may be NULL; otherwise it receives the number
+// of bytes actually read
+unsigned char* read_file_binary(const char* fname, size_t* len);
 char* read_file(const char* fname);
 
+// now_ns - monotonic clock in nanoseconds
+unsigned long long now_ns();
+
+// put_u32/get_u32 - little endian, as in every file and message format here
+void put_u32(unsigned char* b, unsigned int v);
+unsigned int get_u32(const unsigned char* b);
+
 #endif // UTILS_H
\ No newline at end of file